@@ -4,6 +4,10 @@
 #define NULL    ((void *)0)
 #endif
 
+// Checks preemption by counting the ticks a spinning thread of the same priority takes, which only holds while
+// one thread runs at a time, so the VM refuses to run it with more than one worker
+const int VMSingleWorker = 1;
+
 TVMMutexID TheMutex;
 volatile int TheMutexAcquired = 0;
 
@@ -4,6 +4,10 @@
 #define NULL    ((void *)0)
 #endif
 
+// Checks preemption by counting the ticks a spinning thread of the same priority takes, which only holds while
+// one thread runs at a time, so the VM refuses to run it with more than one worker
+const int VMSingleWorker = 1;
+
 TVMMutexID TheMutex;
 volatile int TheMutexAcquired = 0;
 volatile int MemoryAllocationSuccess = -1;
@@ -42,7 +46,7 @@ void VMMain(int argc, char *argv[]){
     TVMThreadState VMState;
     TVMMutexID BadMutexID;
     TVMMemoryPoolID MemoryPool1;
-    TVMMemorySize SystemPoolSize;
+    TVMMemorySize SystemPoolSize, SystemPoolReserve;
     TVMTick CurrentTick, LastTick;
     char *LocalAllocation;
     int MSPerTick;
@@ -62,6 +66,10 @@ void VMMain(int argc, char *argv[]){
         VMPrint("VMMemoryPoolQuery doesn't return success with valid inputs.\n");    
         return;
     }
+    if(VM_STATUS_SUCCESS != VMMemoryPoolQueryReserve(VM_MEMORY_POOL_ID_SYSTEM, &SystemPoolReserve)){
+        VMPrint("VMMemoryPoolQueryReserve doesn't return success with valid inputs.\n");    
+        return;
+    }
     VMPrint("VMMain VMMemoryPoolQuery appears OK.\n");
     VMPrint("VMMain testing VMMemoryPoolAllocate.\n");
     if(VM_STATUS_ERROR_INVALID_PARAMETER != VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, 0, (void **)&MemoryBase1)){
@@ -76,7 +84,7 @@ void VMMain(int argc, char *argv[]){
         VMPrint("VMMemoryPoolAllocate doesn't handle bad memoryid.\n");    
         return;
     }
-    if(VM_STATUS_ERROR_INSUFFICIENT_RESOURCES  != VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, SystemPoolSize + 256, (void **)&MemoryBase1)){
+    if(VM_STATUS_ERROR_INSUFFICIENT_RESOURCES  != VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, SystemPoolSize + SystemPoolReserve + 256, (void **)&MemoryBase1)){
         VMPrint("VMMemoryPoolAllocate doesn't handle insufficient resources.\n");    
         return;
     }
@@ -1,5 +1,7 @@
 #include "VirtualMachine.h"
 #include <fcntl.h>
+#include <string.h>
+#include <time.h>
 
 #include <stdio.h>
 #ifndef NULL
@@ -8,6 +10,10 @@
 
 #define QUEUE_BUFFER_SIZE  1024
 
+#define BENCH_MIN_SIZE      0x1000
+#define BENCH_MAX_SIZE      0x4000000
+#define BENCH_BUFFER_SIZE   0x100000
+
 typedef struct{
     volatile int DHead;
     volatile int DTail;
@@ -16,17 +22,9 @@ typedef struct{
     TVMMutexID DMutex; 
 } SProtectedQueue, *SProtectedQueueRef;
 
-typedef struct WAIT_NODE {
-    volatile int *DFlag;
-    struct WAIT_NODE *DNext;
-} SWaitNode, *SWaitNodeRef;
-
 typedef struct{
-    volatile int DValue;
+    TVMSemaphoreID DSemaphore;
     volatile int DWaits;
-    TVMMutexID DMutex;
-    SWaitNodeRef DHead;
-    SWaitNodeRef DTail;
 } SSemaphore, *SSemaphoreRef;
 
 TVMThreadID VMThreadIDProducer, VMThreadIDConsumer;
@@ -59,42 +57,14 @@ char Dequeue(SProtectedQueueRef q){
 }
 
 void Down(SSemaphoreRef s){
-    volatile int WaitingFlag;
-    SWaitNode WaitingNode;
-    VMMutexAcquire(s->DMutex, VM_TIMEOUT_INFINITE);
-    s->DValue--;
-    if(s->DValue < 0){
+    if(VM_STATUS_SUCCESS != VMSemaphoreDown(s->DSemaphore, VM_TIMEOUT_IMMEDIATE)){
         s->DWaits++;
-        WaitingFlag = 1;
-        WaitingNode.DFlag = &WaitingFlag;
-        WaitingNode.DNext = NULL;
-        if(NULL == s->DTail){
-            s->DHead = s->DTail = &WaitingNode;
-        }
-        while(WaitingFlag){
-            VMMutexRelease(s->DMutex);
-            VMThreadSleep(0);
-            VMMutexAcquire(s->DMutex, VM_TIMEOUT_INFINITE);   
-        }
+        VMSemaphoreDown(s->DSemaphore, VM_TIMEOUT_INFINITE);
     }
-    VMMutexRelease(s->DMutex);
 }
 
 void Up(SSemaphoreRef s){
-    SWaitNodeRef WaitingNode;
-    VMMutexAcquire(s->DMutex, VM_TIMEOUT_INFINITE);
-    s->DValue++;
-    if(s->DValue <= 0){
-        if(NULL != s->DHead){
-            WaitingNode = s->DHead;
-            s->DHead = s->DHead->DNext;
-            if(NULL == s->DHead){
-                s->DTail = NULL;   
-            }
-            *WaitingNode->DFlag = 0;
-        }
-    }
-    VMMutexRelease(s->DMutex);
+    VMSemaphoreUp(s->DSemaphore);
 }
 
 
@@ -199,23 +169,128 @@ void VMThreadConsumer(void *param){
     VMPrint("VMThreadConsumer Complete\n");
 }
 
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Copies src to dest through buffer a buffer at a time, with the zero copy calls if buffer is a shared buffer,
+// returns the number of bytes copied or -1 on an error
+int CopyWhole(const char *src, const char *dest, char *buffer, int buffersize, int shared){
+    int SourceDescriptor, DestDescriptor;
+    int BytesRead, BytesWritten, Total = 0;
+
+    if(VM_STATUS_SUCCESS != VMFileOpen(src, O_RDONLY, 0644, &SourceDescriptor)){
+        return -1;
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen(dest, O_CREAT | O_TRUNC | O_RDWR, 0644, &DestDescriptor)){
+        VMFileClose(SourceDescriptor);
+        return -1;
+    }
+    do{
+        BytesRead = buffersize;
+        if(VM_STATUS_SUCCESS != (shared ? VMFileReadShared : VMFileRead)(SourceDescriptor, buffer, &BytesRead)){
+            Total = -1;
+            break;
+        }
+        BytesWritten = BytesRead;
+        if(BytesRead && ((VM_STATUS_SUCCESS != (shared ? VMFileWriteShared : VMFileWrite)(DestDescriptor, buffer, &BytesWritten))||(BytesWritten != BytesRead))){
+            Total = -1;
+            break;
+        }
+        Total += BytesRead;
+    }while(BytesRead);
+    VMFileClose(SourceDescriptor);
+    VMFileClose(DestDescriptor);
+    return Total;
+}
+
+// Copies files from BENCH_MIN_SIZE up to BENCH_MAX_SIZE through a large buffer and reports the throughput, and
+// again through a shared buffer as large as the shared space has room for, up to BENCH_BUFFER_SIZE
+void CopyBenchmark(const char *prefix){
+    char SourceName[256], DestName[256];
+    struct timespec Start, End;
+    char *Buffer, *SharedBuffer = NULL;
+    int FileSize, FileDescriptor, Length, Copied, Index;
+    TVMMemorySize SharedSize;
+    double Elapsed, SharedElapsed;
+
+    snprintf(SourceName, sizeof(SourceName), "%s.src", prefix);
+    snprintf(DestName, sizeof(DestName), "%s.dst", prefix);
+    if(VM_STATUS_SUCCESS != VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, BENCH_BUFFER_SIZE, (void **)&Buffer)){
+        VMPrint("VMMain failed to allocate copy buffer\n");
+        return;
+    }
+    VMSharedBufferQuery(&SharedSize);
+    if(BENCH_BUFFER_SIZE < SharedSize){
+        SharedSize = BENCH_BUFFER_SIZE;
+    }
+    if((BENCH_MIN_SIZE > SharedSize)||(VM_STATUS_SUCCESS != VMSharedBufferAllocate(SharedSize, (void **)&SharedBuffer))){
+        VMPrint("No room for a shared buffer, try a larger -s to compare zero copy\n");
+        SharedBuffer = NULL;
+    }
+    else if(BENCH_BUFFER_SIZE > SharedSize){
+        VMPrint("Shared buffer is %u bytes, try a larger -s for %d\n", SharedSize, BENCH_BUFFER_SIZE);
+    }
+    for(Index = 0; Index < BENCH_BUFFER_SIZE; Index++){
+        Buffer[Index] = Index * 7;
+    }
+    for(FileSize = BENCH_MIN_SIZE; FileSize <= BENCH_MAX_SIZE; FileSize *= 4){
+        if(VM_STATUS_SUCCESS != VMFileOpen(SourceName, O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptor)){
+            VMPrint("VMMain failed to create %s\n", SourceName);
+            break;
+        }
+        for(Index = 0; Index < FileSize; Index += Length){
+            Length = FileSize - Index < BENCH_BUFFER_SIZE ? FileSize - Index : BENCH_BUFFER_SIZE;
+            VMFileWrite(FileDescriptor, Buffer, &Length);
+        }
+        VMFileClose(FileDescriptor);
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+        Copied = CopyWhole(SourceName, DestName, Buffer, BENCH_BUFFER_SIZE, 0);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+        if(Copied != FileSize){
+            VMPrint("VMMain copy of %d bytes failed, copied %d\n", FileSize, Copied);
+            break;
+        }
+        Elapsed = ElapsedNS(&Start, &End);
+        if(NULL == SharedBuffer){
+            VMPrint("%9d bytes: %8.1f us, %7.1f MB/s\n", FileSize, Elapsed / 1e3, FileSize / (Elapsed / 1e3));
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+        Copied = CopyWhole(SourceName, DestName, SharedBuffer, SharedSize, 1);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+        if(Copied != FileSize){
+            VMPrint("VMMain shared copy of %d bytes failed, copied %d\n", FileSize, Copied);
+            break;
+        }
+        SharedElapsed = ElapsedNS(&Start, &End);
+        VMPrint("%9d bytes: %8.1f us, %7.1f MB/s, shared buffer %8.1f us, %7.1f MB/s\n", FileSize, Elapsed / 1e3, FileSize / (Elapsed / 1e3), SharedElapsed / 1e3, FileSize / (SharedElapsed / 1e3));
+    }
+    if(NULL != SharedBuffer){
+        VMSharedBufferRelease(SharedBuffer);
+    }
+    VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, Buffer);
+}
+
 void VMMain(int argc, char *argv[]){
     TVMThreadState VMStateP, VMStateC;
     int LocalRead, LocalWrite, LocalEnqueue, LocalDequeue, LocalCount, LocalWaits;
+    if((argc == 3)&&(0 == strcmp(argv[1], "-b"))){
+        // copyfile -b scratch copies scratch.src to scratch.dst at a range of sizes
+        CopyBenchmark(argv[2]);
+        VMPrint("VMMain Goodbye\n");
+        return;
+    }
     if(argc != 3){
-        VMPrint("VMMain invalid number of arguments. Should be copyfile src dest\n");
+        VMPrint("VMMain invalid number of arguments. Should be copyfile src dest, or copyfile -b scratch\n");
         return;
     }
     
     VMPrint("VMMain creating semaphore and queue mutexes\n");    
-    VMMutexCreate(&Empty.DMutex);
-    Empty.DValue = sizeof(SharedQueue.DBuffer);
+    VMSemaphoreCreate(&Empty.DSemaphore, sizeof(SharedQueue.DBuffer));
     Empty.DWaits = 0;
-    Empty.DHead = Empty.DTail = NULL;
-    VMMutexCreate(&Full.DMutex);
-    Full.DValue = 0;
+    VMSemaphoreCreate(&Full.DSemaphore, 0);
     Full.DWaits = 0;
-    Full.DHead = Full.DTail = NULL;
     VMMutexCreate(&SharedQueue.DMutex);
     SharedQueue.DHead = SharedQueue.DTail = SharedQueue.DCount = 0;
     VMPrint("VMMain creating threads\n");        
@@ -0,0 +1,42 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define BENCH_DEFAULT_TICKS     50
+
+double CPUTimeMS(void){
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return (Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec) * 1e3 + (Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec) / 1e3;
+}
+
+double WallTimeMS(void){
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return Now.tv_sec * 1e3 + Now.tv_nsec / 1e6;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMTick SleepTicks = BENCH_DEFAULT_TICKS;
+    TVMTick StartTick, EndTick;
+    double StartWall, StartCPU, Wall, CPU;
+
+    if(1 < argc){
+        SleepTicks = atoi(argv[1]);
+        if(0 == SleepTicks){
+            SleepTicks = BENCH_DEFAULT_TICKS;
+        }
+    }
+    VMPrint("Sleeping %u ticks with nothing else runnable\n", SleepTicks);
+    VMTickCount(&StartTick);
+    StartWall = WallTimeMS();
+    StartCPU = CPUTimeMS();
+    VMThreadSleep(SleepTicks);
+    CPU = CPUTimeMS() - StartCPU;
+    Wall = WallTimeMS() - StartWall;
+    VMTickCount(&EndTick);
+    VMPrint("ticks %u wall %.1f ms cpu %.1f ms idle cpu usage %.2f%%\n", EndTick - StartTick, Wall, CPU, 100.0 * CPU / Wall);
+    VMPrint("Goodbye\n");
+}
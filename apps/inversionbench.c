@@ -0,0 +1,64 @@
+#include "VirtualMachine.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_STACK_SIZE        0x10000
+#define BENCH_HOLD_TICKS        5
+#define BENCH_SPIN_TICKS        100
+
+TVMMutexID SharedMutex;
+volatile int HighLatency = -1;
+
+void SpinTicks(TVMTick ticks){
+    TVMTick Start, Now;
+
+    VMTickCount(&Start);
+    do{
+        VMTickCount(&Now);
+    }while(Now - Start < ticks);
+}
+
+void VMThreadLow(void *param){
+    VMMutexAcquire(SharedMutex, VM_TIMEOUT_INFINITE);
+    SpinTicks(BENCH_HOLD_TICKS);
+    VMMutexRelease(SharedMutex);
+}
+
+void VMThreadMedium(void *param){
+    SpinTicks(BENCH_SPIN_TICKS);
+}
+
+void VMThreadHigh(void *param){
+    TVMTick Start, End;
+
+    VMTickCount(&Start);
+    VMMutexAcquire(SharedMutex, VM_TIMEOUT_INFINITE);
+    VMTickCount(&End);
+    VMMutexRelease(SharedMutex);
+    HighLatency = End - Start;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID VMThreadIDLow, VMThreadIDMedium, VMThreadIDHigh;
+    TVMThreadState VMState;
+
+    VMMutexCreate(&SharedMutex);
+    VMThreadCreate(VMThreadLow, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_LOW, &VMThreadIDLow);
+    VMThreadCreate(VMThreadMedium, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_NORMAL, &VMThreadIDMedium);
+    VMThreadCreate(VMThreadHigh, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &VMThreadIDHigh);
+
+    // Let the low thread take the mutex, then start a normal thread spinning and a high thread that needs the mutex
+    VMThreadActivate(VMThreadIDLow);
+    VMThreadSleep(1);
+    VMThreadActivate(VMThreadIDMedium);
+    VMThreadActivate(VMThreadIDHigh);
+    do{
+        VMThreadSleep(1);
+        VMThreadState(VMThreadIDMedium, &VMState);
+    }while(VM_THREAD_STATE_DEAD != VMState);
+
+    VMPrint("High priority thread waited %d ticks for a mutex held %d ticks (normal thread spun %d ticks)\n", HighLatency, BENCH_HOLD_TICKS, BENCH_SPIN_TICKS);
+    VMPrint("Goodbye\n");
+}
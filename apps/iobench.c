@@ -0,0 +1,102 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_MAX_THREADS       1024
+#define BENCH_DEFAULT_THREADS   300     // More transfers than the machine can queue at once
+#define BENCH_DEFAULT_CHUNK     0x10000
+#define BENCH_MAX_CHUNK         0x1000000
+
+typedef struct{
+    const char *DFileName;
+    int DChunk;
+    char *DBuffer;
+    long long DBytes;
+    int DFailed;
+} SReader, *SReaderRef;
+
+SReader BenchReaders[BENCH_MAX_THREADS];
+TVMThreadID BenchThreads[BENCH_MAX_THREADS];
+
+// Reads the whole file through in chunk sized reads, like a thread serving one request
+void VMThread(void *param){
+    SReaderRef Reader = (SReaderRef)param;
+    int FileDescriptor, Length;
+
+    if(VM_STATUS_SUCCESS != VMFileOpen(Reader->DFileName, O_RDONLY, 0644, &FileDescriptor)){
+        Reader->DFailed = 1;
+        return;
+    }
+    do{
+        Length = Reader->DChunk;
+        if(VM_STATUS_SUCCESS != VMFileRead(FileDescriptor, Reader->DBuffer, &Length)){
+            Reader->DFailed = 1;
+            break;
+        }
+        Reader->DBytes += Length;
+    }while(Length == Reader->DChunk);
+    VMFileClose(FileDescriptor);
+}
+
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMMain(int argc, char *argv[]){
+    struct timespec Start, End;
+    int ThreadCount = BENCH_DEFAULT_THREADS;
+    int Chunk = BENCH_DEFAULT_CHUNK;
+    int Index, ExitCode, Failed = 0;
+    long long Total = 0;
+    double Elapsed;
+
+    if(2 > argc){
+        VMPrint("Usage: iobench file [threads] [chunk]\n");
+        return;
+    }
+    if(2 < argc){
+        ThreadCount = atoi(argv[2]);
+        if((0 >= ThreadCount)||(BENCH_MAX_THREADS < ThreadCount)){
+            VMPrint("Thread count must be between 1 and %d\n", BENCH_MAX_THREADS);
+            return;
+        }
+    }
+    if(3 < argc){
+        Chunk = strtol(argv[3], NULL, 0);
+        if((0 >= Chunk)||(BENCH_MAX_CHUNK < Chunk)){
+            VMPrint("Chunk size must be between 1 and %d\n", BENCH_MAX_CHUNK);
+            return;
+        }
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        BenchReaders[Index].DFileName = argv[1];
+        BenchReaders[Index].DChunk = Chunk;
+        if(VM_STATUS_SUCCESS != VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, Chunk, (void **)&BenchReaders[Index].DBuffer)){
+            VMPrintError("Failed to allocate read buffer %d, try a larger -h\n", Index);
+            return;
+        }
+        VMThreadCreate(VMThread, &BenchReaders[Index], 0x10000, VM_THREAD_PRIORITY_NORMAL, &BenchThreads[Index]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadActivate(BenchThreads[Index]);
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadJoin(BenchThreads[Index], VM_TIMEOUT_INFINITE, &ExitCode);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadDelete(BenchThreads[Index]);
+        VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, BenchReaders[Index].DBuffer);
+        Total += BenchReaders[Index].DBytes;
+        Failed += BenchReaders[Index].DFailed;
+    }
+    Elapsed = ElapsedNS(&Start, &End);
+    VMPrint("%d threads reading in %d byte chunks: %lld bytes in %.1f ms, %.1f MB/s, %d failed\n", ThreadCount, Chunk, Total, Elapsed / 1e6, Total / Elapsed * 1e3, Failed);
+    VMPrint("Goodbye\n");
+}
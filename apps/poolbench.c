@@ -0,0 +1,245 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_POOL_SIZE         0x800000
+#define BENCH_MAX_LIVE          65536
+#define BENCH_DEFAULT_LIVE      4096
+#define BENCH_DEFAULT_OPS       1000000
+#define BENCH_OBJECT_SIZE       48
+#define BENCH_REQUEST_BLOCKS    32
+#define BENCH_REQUEST_COUNT     100000
+#define BENCH_GROW_BUFFERS      16
+#define BENCH_GROW_STEP         64
+#define BENCH_GROW_LIMIT        8192
+#define BENCH_GROW_COUNT        2000
+
+void *BenchBlocks[BENCH_MAX_LIVE];
+unsigned int BenchSeed = 1;
+
+unsigned int BenchRandom(void){
+    BenchSeed = BenchSeed * 1664525 + 1013904223;
+    return BenchSeed >> 8;
+}
+
+// Mostly small blocks with some medium and a few large ones, like the node and buffer mix the apps allocate
+TVMMemorySize BenchSize(void){
+    unsigned int Kind = BenchRandom() % 100;
+
+    if(Kind < 75){
+        return 16 + BenchRandom() % 240;
+    }
+    if(Kind < 95){
+        return 256 + BenchRandom() % 3840;
+    }
+    return 4096 + BenchRandom() % 28672;
+}
+
+TVMMemorySize BenchObjectSize(void){
+    return BENCH_OBJECT_SIZE;
+}
+
+// Powers of two from 64 bytes to 16 KB, like stacks and IO buffers
+TVMMemorySize BenchPowerSize(void){
+    return (TVMMemorySize)64 << (BenchRandom() % 9);
+}
+
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Each op frees the block in a random slot, or allocates one if the slot is empty. Returns ns per op.
+double BenchChurn(TVMMemoryPoolID poolid, int livecount, int opcount, TVMMemorySize (*sizer)(void), int *failed){
+    struct timespec Start, End;
+    int Index, Slot;
+
+    *failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < opcount; Index++){
+        Slot = BenchRandom() % livecount;
+        if(NULL != BenchBlocks[Slot]){
+            VMMemoryPoolDeallocate(poolid, BenchBlocks[Slot]);
+            BenchBlocks[Slot] = NULL;
+        }
+        else if(VM_STATUS_SUCCESS != VMMemoryPoolAllocate(poolid, sizer(), &BenchBlocks[Slot])){
+            BenchBlocks[Slot] = NULL;
+            (*failed)++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    return ElapsedNS(&Start, &End) / opcount;
+}
+
+void BenchFreeAll(TVMMemoryPoolID poolid, int livecount){
+    int Index;
+
+    for(Index = 0; Index < livecount; Index++){
+        if(NULL != BenchBlocks[Index]){
+            VMMemoryPoolDeallocate(poolid, BenchBlocks[Index]);
+            BenchBlocks[Index] = NULL;
+        }
+    }
+}
+
+// Runs the power of two churn and reports how broken up the free space is while the blocks are still live
+void BenchFragmentation(TVMMemoryPoolID poolid, const char *name, int livecount, int opcount){
+    TVMMemorySize FreeBytes, Largest;
+    unsigned int Percent;
+    int Failed;
+    double PerOp;
+
+    // Every pool gets the same sequence of sizes and slots
+    BenchSeed = 1;
+    PerOp = BenchChurn(poolid, livecount, opcount, BenchPowerSize, &Failed);
+    VMMemoryPoolQuery(poolid, &FreeBytes);
+    VMMemoryPoolQueryFragmentation(poolid, &Largest, &Percent);
+    VMPrint("Power of two blocks, %s pool: %.1f ns per op, %d failed, %u bytes free, largest %u, %u%% fragmented\n", name, PerOp, Failed, FreeBytes, Largest, Percent);
+    BenchFreeAll(poolid, livecount);
+}
+
+// How many objsize objects fit in the empty pool, going by how much one of them takes out of it
+unsigned int BenchCapacity(TVMMemoryPoolID poolid, TVMMemorySize objsize){
+    TVMMemorySize Before, After;
+    void *Object;
+
+    VMMemoryPoolQuery(poolid, &Before);
+    VMMemoryPoolAllocate(poolid, objsize, &Object);
+    VMMemoryPoolQuery(poolid, &After);
+    VMMemoryPoolDeallocate(poolid, Object);
+    return Before / (Before - After);
+}
+
+// Like a request handler, allocates a batch of buffers and then drops all of them. Returns ns per request.
+double BenchRequests(TVMMemoryPoolID poolid, int arena){
+    struct timespec Start, End;
+    int Request, Index;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Request = 0; Request < BENCH_REQUEST_COUNT; Request++){
+        for(Index = 0; Index < BENCH_REQUEST_BLOCKS; Index++){
+            VMMemoryPoolAllocate(poolid, 16 + BenchRandom() % 1008, &BenchBlocks[Index]);
+        }
+        if(arena){
+            VMMemoryPoolReset(poolid);
+        }
+        else{
+            for(Index = 0; Index < BENCH_REQUEST_BLOCKS; Index++){
+                VMMemoryPoolDeallocate(poolid, BenchBlocks[Index]);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    for(Index = 0; Index < BENCH_REQUEST_BLOCKS; Index++){
+        BenchBlocks[Index] = NULL;
+    }
+    return ElapsedNS(&Start, &End) / BENCH_REQUEST_COUNT;
+}
+
+// Grows a set of buffers a step at a time, round robin, like appending to several strings at once. Each step is
+// a reallocate, or an allocate, copy and free. Returns ns per step.
+double BenchGrowth(TVMMemoryPoolID poolid, int reallocate){
+    struct timespec Start, End;
+    TVMMemorySize Size;
+    void *Grown;
+    int Round, Index, Steps = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Round = 0; Round < BENCH_GROW_COUNT; Round++){
+        for(Index = 0; Index < BENCH_GROW_BUFFERS; Index++){
+            VMMemoryPoolAllocate(poolid, BENCH_GROW_STEP, &BenchBlocks[Index]);
+        }
+        for(Size = 2 * BENCH_GROW_STEP; Size <= BENCH_GROW_LIMIT; Size += BENCH_GROW_STEP){
+            for(Index = 0; Index < BENCH_GROW_BUFFERS; Index++){
+                if(reallocate){
+                    VMMemoryPoolReallocate(poolid, BenchBlocks[Index], Size, &BenchBlocks[Index]);
+                }
+                else{
+                    VMMemoryPoolAllocate(poolid, Size, &Grown);
+                    memcpy(Grown, BenchBlocks[Index], Size - BENCH_GROW_STEP);
+                    VMMemoryPoolDeallocate(poolid, BenchBlocks[Index]);
+                    BenchBlocks[Index] = Grown;
+                }
+                Steps++;
+            }
+        }
+        BenchFreeAll(poolid, BENCH_GROW_BUFFERS);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    return ElapsedNS(&Start, &End) / Steps;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMMemoryPoolID PoolID;
+    TVMMemorySize FreeBytes, HighWater;
+    void *PoolBase;
+    int LiveCount = BENCH_DEFAULT_LIVE;
+    int OpCount = BENCH_DEFAULT_OPS;
+    int Failed;
+    double PerOp;
+
+    if(1 < argc){
+        LiveCount = atoi(argv[1]);
+        if((0 >= LiveCount)||(BENCH_MAX_LIVE < LiveCount)){
+            VMPrint("Live block count must be between 1 and %d\n", BENCH_MAX_LIVE);
+            return;
+        }
+    }
+    if(2 < argc){
+        OpCount = atoi(argv[2]);
+    }
+    if(VM_STATUS_SUCCESS != VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, BENCH_POOL_SIZE, &PoolBase)){
+        VMPrintError("Failed to allocate pool space, try a larger -h\n");
+        return;
+    }
+    VMMemoryPoolCreate(PoolBase, BENCH_POOL_SIZE, &PoolID);
+    PerOp = BenchChurn(PoolID, LiveCount, OpCount, BenchSize, &Failed);
+    BenchFreeAll(PoolID, LiveCount);
+    VMPrint("%d ops with up to %d live blocks: %.1f ns per op, %d allocations failed\n", OpCount, LiveCount, PerOp, Failed);
+    VMMemoryPoolQuery(PoolID, &FreeBytes);
+    VMPrint("%u of %u bytes free after freeing everything\n", FreeBytes, BENCH_POOL_SIZE);
+
+    // The same churn with one small object size, through the general pool and then a fixed pool on the same space
+    PerOp = BenchChurn(PoolID, LiveCount, OpCount, BenchObjectSize, &Failed);
+    BenchFreeAll(PoolID, LiveCount);
+    VMPrint("%d byte objects, general pool: %.1f ns per op, %u fit\n", BENCH_OBJECT_SIZE, PerOp, BenchCapacity(PoolID, BENCH_OBJECT_SIZE));
+    VMMemoryPoolDelete(PoolID);
+    VMMemoryPoolCreateFixed(PoolBase, BENCH_POOL_SIZE, BENCH_OBJECT_SIZE, &PoolID);
+    PerOp = BenchChurn(PoolID, LiveCount, OpCount, BenchObjectSize, &Failed);
+    BenchFreeAll(PoolID, LiveCount);
+    VMPrint("%d byte objects, fixed pool: %.1f ns per op, %u fit\n", BENCH_OBJECT_SIZE, PerOp, BenchCapacity(PoolID, BENCH_OBJECT_SIZE));
+    VMMemoryPoolDelete(PoolID);
+
+    // Batches of short lived buffers, freed one at a time from a general pool or all at once from an arena
+    VMMemoryPoolCreate(PoolBase, BENCH_POOL_SIZE, &PoolID);
+    PerOp = BenchRequests(PoolID, 0);
+    VMPrint("%d buffer requests, general pool: %.1f ns per request\n", BENCH_REQUEST_BLOCKS, PerOp);
+    VMMemoryPoolDelete(PoolID);
+    VMMemoryPoolCreateArena(PoolBase, BENCH_POOL_SIZE, &PoolID);
+    PerOp = BenchRequests(PoolID, 1);
+    VMMemoryPoolQueryHighWater(PoolID, &HighWater);
+    VMPrint("%d buffer requests, arena pool: %.1f ns per request, high water %u bytes\n", BENCH_REQUEST_BLOCKS, PerOp, HighWater);
+    VMMemoryPoolDelete(PoolID);
+
+    // Power of two sizes through first fit and through a buddy pool
+    VMMemoryPoolCreate(PoolBase, BENCH_POOL_SIZE, &PoolID);
+    BenchFragmentation(PoolID, "general", LiveCount, OpCount);
+    VMMemoryPoolDelete(PoolID);
+    VMMemoryPoolCreateBuddy(PoolBase, BENCH_POOL_SIZE, &PoolID);
+    BenchFragmentation(PoolID, "buddy", LiveCount, OpCount);
+    VMMemoryPoolDelete(PoolID);
+
+    // Buffers growing side by side, copied on every step or reallocated in place where there is room
+    VMMemoryPoolCreate(PoolBase, BENCH_POOL_SIZE, &PoolID);
+    PerOp = BenchGrowth(PoolID, 0);
+    VMPrint("%d growing buffers, allocate and copy: %.1f ns per step\n", BENCH_GROW_BUFFERS, PerOp);
+    PerOp = BenchGrowth(PoolID, 1);
+    VMPrint("%d growing buffers, reallocate: %.1f ns per step\n", BENCH_GROW_BUFFERS, PerOp);
+    VMMemoryPoolDelete(PoolID);
+    VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, PoolBase);
+    VMPrint("Goodbye\n");
+}
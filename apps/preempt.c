@@ -23,9 +23,8 @@ void VMThread(void *param){
 
 void VMMain(int argc, char *argv[]){
     TVMThreadID VMThreadID1, VMThreadID2;
-    TVMThreadState VMState1, VMState2;
     volatile int Val1 = 0, Val2 = 0;
-    volatile int LocalVal1, LocalVal2;
+    int ExitCode;
     VMPrint("VMMain creating threads.\n");
     VMThreadCreate(VMThread, (void *)&Val1, 0x100000, VM_THREAD_PRIORITY_LOW, &VMThreadID1);
     VMThreadCreate(VMThread, (void *)&Val2, 0x100000, VM_THREAD_PRIORITY_LOW, &VMThreadID2);
@@ -33,14 +32,9 @@ void VMMain(int argc, char *argv[]){
     VMThreadActivate(VMThreadID1);
     VMThreadActivate(VMThreadID2);
     VMPrint("VMMain Waiting\n");
-    do{
-        LocalVal1 = Val1; 
-        LocalVal2 = Val2;
-        VMThreadState(VMThreadID1, &VMState1);
-        VMThreadState(VMThreadID2, &VMState2);
-        VMPrint("%d %d\n", LocalVal1, LocalVal2);
-        VMThreadSleep(2);
-    }while((VM_THREAD_STATE_DEAD != VMState1)||(VM_THREAD_STATE_DEAD != VMState2));
+    VMThreadJoin(VMThreadID1, VM_TIMEOUT_INFINITE, &ExitCode);
+    VMThreadJoin(VMThreadID2, VM_TIMEOUT_INFINITE, &ExitCode);
+    VMPrint("%d %d\n", Val1, Val2);
     VMPrint("VMMain Done\n");
     VMPrint("Goodbye\n");
 }
@@ -0,0 +1,61 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_STACK_SIZE        0x100000
+#define BENCH_MAX_THREADS       64
+#define BENCH_DEFAULT_THREADS   4
+#define BENCH_DEFAULT_WORK      200000000
+
+TVMThreadID BenchThreads[BENCH_MAX_THREADS];
+volatile unsigned int BenchResults[BENCH_MAX_THREADS];
+unsigned int BenchWork;
+
+// CPU bound like preempt.c, but a fixed amount of work instead of a fixed time so the wall clock can be compared
+void VMThread(void *param){
+    int Index = (int)(long)param;
+    unsigned int Value = Index + 1;
+    unsigned int Count;
+
+    for(Count = 0; Count < BenchWork; Count++){
+        Value = Value * 1664525 + 1013904223;
+    }
+    BenchResults[Index] = Value;
+}
+
+void VMMain(int argc, char *argv[]){
+    struct timespec Start, End;
+    int ThreadCount = BENCH_DEFAULT_THREADS;
+    int Index, ExitCode;
+    double ElapsedMS;
+
+    BenchWork = BENCH_DEFAULT_WORK;
+    if(1 < argc){
+        ThreadCount = atoi(argv[1]);
+        if((0 >= ThreadCount)||(BENCH_MAX_THREADS < ThreadCount)){
+            VMPrint("Thread count must be between 1 and %d\n", BENCH_MAX_THREADS);
+            return;
+        }
+    }
+    if(2 < argc){
+        BenchWork = atoi(argv[2]);
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadCreate(VMThread, (void *)(long)Index, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_LOW, &BenchThreads[Index]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadActivate(BenchThreads[Index]);
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadJoin(BenchThreads[Index], VM_TIMEOUT_INFINITE, &ExitCode);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    ElapsedMS = (End.tv_sec - Start.tv_sec) * 1e3 + (End.tv_nsec - Start.tv_nsec) / 1e6;
+    VMPrint("%d threads x %u iterations: %.1f ms\n", ThreadCount, BenchWork, ElapsedMS);
+    VMPrint("Goodbye\n");
+}
@@ -0,0 +1,84 @@
+#include "VirtualMachine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_STACK_SIZE        0x4000
+#define BENCH_YIELD_COUNT       100000
+#define BENCH_MAX_THREADS       8192
+
+TVMThreadID BenchThreads[BENCH_MAX_THREADS];
+
+void VMThread(void *param){
+
+}
+
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void RunBenchmark(int threadcount){
+    struct timespec Start, End;
+    double ActivateNS, YieldNS, TerminateNS;
+    int Index;
+
+    for(Index = 0; Index < threadcount; Index++){
+        if(VM_STATUS_SUCCESS != VMThreadCreate(VMThread, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_LOW, &BenchThreads[Index])){
+            VMPrintError("Failed to create thread %d, try a larger -h\n", Index);
+            return;
+        }
+    }
+    // Low priority threads never run while VMMain is runnable, so they all pile up in the ready queue
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < threadcount; Index++){
+        VMThreadActivate(BenchThreads[Index]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    ActivateNS = ElapsedNS(&Start, &End) / threadcount;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < BENCH_YIELD_COUNT; Index++){
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    YieldNS = ElapsedNS(&Start, &End) / BENCH_YIELD_COUNT;
+
+    // Terminate from the back of the queue, the worst case for a scan based run queue
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = threadcount - 1; Index >= 0; Index--){
+        VMThreadTerminate(BenchThreads[Index]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    TerminateNS = ElapsedNS(&Start, &End) / threadcount;
+
+    for(Index = 0; Index < threadcount; Index++){
+        VMThreadDelete(BenchThreads[Index]);
+    }
+    VMPrint("%8d %12.1f %12.1f %12.1f\n", threadcount, ActivateNS, YieldNS, TerminateNS);
+}
+
+void VMMain(int argc, char *argv[]){
+    int Counts[] = {16, 64, 256, 512};
+    int Index;
+
+    VMPrint(" threads  activate ns     yield ns terminate ns\n");
+    if(1 < argc){
+        for(Index = 1; Index < argc; Index++){
+            int Count = atoi(argv[Index]);
+            if((0 < Count)&&(BENCH_MAX_THREADS >= Count)){
+                RunBenchmark(Count);
+            }
+        }
+    }
+    else{
+        for(Index = 0; Index < sizeof(Counts) / sizeof(Counts[0]); Index++){
+            RunBenchmark(Counts[Index]);
+        }
+    }
+    VMPrint("Goodbye\n");
+}
+
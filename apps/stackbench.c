@@ -0,0 +1,91 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_MAX_THREADS       60000
+#define BENCH_DEFAULT_THREADS   100
+#define BENCH_DEFAULT_STACK     0x10000
+#define BENCH_TOUCH_SIZE        1024
+#define BENCH_CHURN_COUNT       100000
+
+TVMThreadID BenchThreads[BENCH_MAX_THREADS];
+TVMSemaphoreID BenchRelease;
+volatile int BenchSink;
+
+// Uses a little stack and then blocks, so most of each stack is never touched
+void VMThread(void *param){
+    volatile char Buffer[BENCH_TOUCH_SIZE];
+    int Index;
+
+    for(Index = 0; Index < BENCH_TOUCH_SIZE; Index++){
+        Buffer[Index] = Index;
+    }
+    BenchSink = Buffer[BENCH_TOUCH_SIZE - 1];
+    VMSemaphoreDown(BenchRelease, VM_TIMEOUT_INFINITE);
+}
+
+void VMEmptyThread(void *param){
+
+}
+
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMMain(int argc, char *argv[]){
+    struct timespec Start, End;
+    TVMMemorySize StackSize = BENCH_DEFAULT_STACK;
+    TVMMemorySize Committed, Total = 0, PoolBefore, PoolAfter;
+    TVMThreadID ThreadID;
+    int ThreadCount = BENCH_DEFAULT_THREADS;
+    int Index, ExitCode;
+
+    if(1 < argc){
+        ThreadCount = atoi(argv[1]);
+        if((0 >= ThreadCount)||(BENCH_MAX_THREADS < ThreadCount)){
+            VMPrint("Thread count must be between 1 and %d\n", BENCH_MAX_THREADS);
+            return;
+        }
+    }
+    if(2 < argc){
+        StackSize = strtol(argv[2], NULL, 0);
+    }
+    VMSemaphoreCreate(&BenchRelease, 0);
+    for(Index = 0; Index < ThreadCount; Index++){
+        if(VM_STATUS_SUCCESS != VMThreadCreate(VMThread, NULL, StackSize, VM_THREAD_PRIORITY_HIGH, &BenchThreads[Index])){
+            VMPrintError("Failed to create thread %d, try a larger -h\n", Index);
+            return;
+        }
+        VMThreadActivate(BenchThreads[Index]);
+    }
+    // Every thread has run up to its semaphore by now
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadStackQuery(BenchThreads[Index], &Committed);
+        Total += Committed;
+    }
+    VMPrint("%d threads with %u byte stacks: %u KB reserved, %u KB committed\n", ThreadCount, StackSize, (unsigned int)(((unsigned long long)ThreadCount * StackSize) / 1024), Total / 1024);
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMSemaphoreUp(BenchRelease);
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadJoin(BenchThreads[Index], VM_TIMEOUT_INFINITE, &ExitCode);
+        VMThreadDelete(BenchThreads[Index]);
+    }
+
+    // Stacks of deleted threads are reused, so churn neither costs a pool search nor leaks
+    VMMemoryPoolQuery(VM_MEMORY_POOL_ID_SYSTEM, &PoolBefore);
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < BENCH_CHURN_COUNT; Index++){
+        VMThreadCreate(VMEmptyThread, NULL, StackSize, VM_THREAD_PRIORITY_LOW, &ThreadID);
+        VMThreadDelete(ThreadID);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    VMMemoryPoolQuery(VM_MEMORY_POOL_ID_SYSTEM, &PoolAfter);
+    VMPrint("create+delete %.1f ns, system pool %u bytes free before, %u after\n", ElapsedNS(&Start, &End) / BENCH_CHURN_COUNT, PoolBefore, PoolAfter);
+    VMSemaphoreDelete(BenchRelease);
+    VMPrint("Goodbye\n");
+}
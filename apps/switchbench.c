@@ -0,0 +1,56 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_STACK_SIZE        0x10000
+#define BENCH_CREATE_COUNT      10000
+#define BENCH_SWITCH_COUNT      200000
+
+volatile int SwitchesLeft;
+
+void VMEmptyThread(void *param){
+
+}
+
+void VMPingPongThread(void *param){
+    while(0 < SwitchesLeft){
+        SwitchesLeft--;
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+    }
+}
+
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMMain(int argc, char *argv[]){
+    struct timespec Start, End;
+    TVMThreadID ThreadID, PingID, PongID;
+    int Index;
+
+    // A low priority thread never gets to run here, so this is purely context creation cost
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < BENCH_CREATE_COUNT; Index++){
+        VMThreadCreate(VMEmptyThread, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_LOW, &ThreadID);
+        VMThreadActivate(ThreadID);
+        VMThreadTerminate(ThreadID);
+        VMThreadDelete(ThreadID);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    VMPrint("create+activate+terminate+delete %.1f ns\n", ElapsedNS(&Start, &End) / BENCH_CREATE_COUNT);
+
+    // Two high priority threads yield back and forth until the count runs out
+    SwitchesLeft = BENCH_SWITCH_COUNT;
+    VMThreadCreate(VMPingPongThread, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &PingID);
+    VMThreadCreate(VMPingPongThread, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &PongID);
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    VMThreadActivate(PingID);
+    VMThreadActivate(PongID);
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    VMPrint("yield switch %.1f ns\n", ElapsedNS(&Start, &End) / BENCH_SWITCH_COUNT);
+    VMPrint("Goodbye\n");
+}
@@ -13,6 +13,7 @@ void VMThread(void *param){
 void VMMain(int argc, char *argv[]){
     TVMThreadID VMThreadID;
     TVMThreadState VMState;
+    int ExitCode;
     VMPrint("VMMain creating thread.\n");
     VMThreadCreate(VMThread, NULL, 0x100000, VM_THREAD_PRIORITY_NORMAL, &VMThreadID);
     VMPrint("VMMain getting thread state: ");
@@ -30,9 +31,9 @@ void VMMain(int argc, char *argv[]){
     }
     VMPrint("VMMain activating thread.\n");
     VMThreadActivate(VMThreadID);
-    VMPrint("VMMain going to sleep 50\n");
-    VMThreadSleep(50);
-    VMPrint("VMMain Awake\nGoodbye\n");
+    VMPrint("VMMain joining thread\n");
+    VMThreadJoin(VMThreadID, VM_TIMEOUT_INFINITE, &ExitCode);
+    VMPrint("VMMain Joined\nGoodbye\n");
     
 }
 
@@ -0,0 +1,83 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define BENCH_MAX_THREADS       1024
+#define BENCH_DEFAULT_THREADS   64
+#define BENCH_DEFAULT_ROUNDS    200
+#define BENCH_STACK_SIZE        0x100000
+#define BENCH_FRAME_SIZE        0xC0000
+#define BENCH_PAGE_STRIDE       (4096 + 64)
+
+TVMThreadID BenchThreads[BENCH_MAX_THREADS];
+int BenchRounds = BENCH_DEFAULT_ROUNDS;
+volatile int BenchSink;
+
+// Touches a line in every page of a large stack frame, then yields, so each switch lands on a different stack
+void VMStackThread(void *param){
+    volatile char Frame[BENCH_FRAME_SIZE];
+    int Round, Offset;
+
+    for(Round = 0; Round < BenchRounds; Round++){
+        for(Offset = 0; Offset < BENCH_FRAME_SIZE; Offset += BENCH_PAGE_STRIDE){
+            Frame[Offset]++;
+        }
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+    }
+    BenchSink = Frame[0];
+}
+
+double ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMMain(int argc, char *argv[]){
+    struct timespec Start, End;
+    TVMMemorySize FreeBytes;
+    void *Buffer;
+    int ThreadCount = BENCH_DEFAULT_THREADS;
+    int Index, ExitCode;
+    long long Touches;
+
+    if(1 < argc){
+        ThreadCount = atoi(argv[1]);
+        if((0 >= ThreadCount)||(BENCH_MAX_THREADS < ThreadCount)){
+            VMPrint("Thread count must be between 1 and %d\n", BENCH_MAX_THREADS);
+            return;
+        }
+    }
+    if(2 < argc){
+        BenchRounds = atoi(argv[2]);
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        if(VM_STATUS_SUCCESS != VMThreadCreate(VMStackThread, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &BenchThreads[Index])){
+            VMPrintError("Failed to create thread %d, try a larger -h\n", Index);
+            return;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadActivate(BenchThreads[Index]);
+    }
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadJoin(BenchThreads[Index], VM_TIMEOUT_INFINITE, &ExitCode);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Touches = (long long)ThreadCount * BenchRounds * ((BENCH_FRAME_SIZE + BENCH_PAGE_STRIDE - 1) / BENCH_PAGE_STRIDE);
+    VMPrint("%d threads with %u byte stacks, %d rounds: %.2f ns per page touch\n", ThreadCount, BENCH_STACK_SIZE, BenchRounds, ElapsedNS(&Start, &End) / Touches);
+    for(Index = 0; Index < ThreadCount; Index++){
+        VMThreadDelete(BenchThreads[Index]);
+    }
+
+    // Buffers can be placed on a page or huge page boundary of their own
+    if(VM_STATUS_SUCCESS == VMMemoryPoolAllocateAligned(VM_MEMORY_POOL_ID_SYSTEM, BENCH_STACK_SIZE, 0x200000, &Buffer)){
+        VMMemoryPoolQuery(VM_MEMORY_POOL_ID_SYSTEM, &FreeBytes);
+        VMPrint("2 MB aligned buffer at offset %u into its huge page, %u bytes left in the system pool\n", (unsigned int)((unsigned long)Buffer & 0x1FFFFF), FreeBytes);
+        VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, Buffer);
+    }
+    VMPrint("Goodbye\n");
+}
@@ -3,11 +3,10 @@
 #include <signal.h>
 #include <time.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
@@ -16,6 +15,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <vector>
 #include <map>
 
@@ -33,18 +34,52 @@ extern "C"{
 #define MACHINE_REQUEST_CLOSE           6
 #define MACHINE_REQUEST_TERMINATE       7
 
-#define MACHINE_MAX_MESSAGE_SIZE        0x10000
 #define MACHINE_PAGE_SIZE               4096
-#define MACHINE_MAX_TRANSFER_SIZE       512
+#define MACHINE_SUBMIT_ENTRIES          MACHINE_MAX_REQUESTS
+#define MACHINE_COMPLETE_ENTRIES        65536
+#define MACHINE_FILENAME_SIZE           256
+#define MACHINE_KICK_SIGNAL             SIGURG
+
+// Requests go to the child and results come back through a pair of single producer single consumer rings in the
+// shared mapping, just past the space handed to the VM. Each side only signals the other when the other has
+// armed its ring before going to sleep, so a busy consumer costs the producer nothing but memory writes.
+typedef struct{
+    volatile uint32_t DHead;        // Next entry the consumer takes, only the consumer writes it
+    uint8_t DHeadPad[60];
+    volatile uint32_t DTail;        // Next entry the producer fills, only the producer writes it
+    volatile int DArmed;            // Set by the consumer when it wants a signal for the next entry
+    uint8_t DTailPad[56];
+} SMachineRingIndex, *SMachineRingIndexRef;
+
+typedef struct{
+    uint32_t DRequestID;
+    int DType;
+    int DFileDescriptor;
+    int DLength;                    // Transfer length, seek offset or open flags
+    int DMode;                      // Open mode, seek whence, or nonzero for a chained read or write
+    uint8_t *DBuffer;
+    char DFileName[MACHINE_FILENAME_SIZE];
+} SMachineSubmission, *SMachineSubmissionRef;
+
+typedef struct{
+    uint32_t DRequestID;
+    int DResult;
+} SMachineCompletion, *SMachineCompletionRef;
+
+typedef struct{
+    SMachineRingIndex DSubmitIndex;
+    SMachineRingIndex DCompleteIndex;
+    SMachineSubmission DSubmissions[MACHINE_SUBMIT_ENTRIES];
+    SMachineCompletion DCompletions[MACHINE_COMPLETE_ENTRIES];
+} SMachineRings, *SMachineRingsRef;
 
 typedef struct{
     pid_t DParentPID;
     pid_t DChildPID;
-    int DRequestChannel;
-    int DReplyChannel;
     int DMMapFile;
     uint8_t *DSharedBase;
     size_t DSharedSize;
+    SMachineRingsRef DRings;
 } SMachineData, *SMachineDataRef;
 
 typedef struct{
@@ -52,34 +87,195 @@ typedef struct{
     void *DCalldata;
 } SMachinePendingCallback, *SMachinePendingCallbackRef;
 
-typedef struct{
-    long DType;
-    uint32_t DRequestID;
-    uint8_t DPayload[1];
-} SMachineRequest, *SMachineRequestRef;
-
 typedef struct{
     uint32_t DRequestID;
     int DFileDescriptor;
     int DLength;
     uint8_t *DBuffer;
+    bool DChained;
 } SMachinePendingRead, *SMachinePendingReadRef;
 
 static bool MachineInitialized = false;
 static SMachineData MachineData;
+#ifdef MACHINE_CONTEXT_SIGNAL
 static SMachineContext MachineContextCaller;
 static sig_atomic_t MachineContextCalled;
 static SMachineContextRef MachineContextCreateRef;
 static void (*MachineContextCreateFunction)(void *);
 static void *MachineContextCreateParam;
 static sigset_t MachineContextCreateSignals;
+#endif
 //static volatile sig_atomic_t MachinePendingRequest = false;
 static int MachineSignalPipe[2];
 static TMachineAlarmCallback MachineAlarmCallback = NULL;
 static void *MachineAlarmCalldata = NULL;
 struct sigaction MachineAlarmActionSave;
 static volatile uint32_t MachineRequestID = 0;
+static __thread int MachineBatchDepth = 0; // Requests are queued without waking the child while nonzero
 static std::map< uint32_t , SMachinePendingCallback > MachinePendingCallbacks;
+static volatile int MachinePendingLock = 0;
+static __thread volatile sig_atomic_t MachineHoldDepth = 0; // Handlers are put off while nonzero
+static __thread volatile int MachineHeldSignals = 0; // Bit per signal that landed while they were put off
+static TMachineAlarmCallback MachineReplyDoneCallback = NULL;
+static void *MachineReplyDoneCalldata = NULL;
+
+typedef struct{
+    TMachineProcessorEntry DEntry;
+    void *DCalldata;
+    int DProcessor;
+} SMachineProcessorStart, *SMachineProcessorStartRef;
+
+static std::vector< pthread_t > MachineProcessors;
+static TMachineAlarmCallback MachineKickCallback = NULL;
+static void *MachineKickCalldata = NULL;
+
+// Rather than masking signals around the pending lock and the reply loop, a processor holds them off in software.
+// A handler that lands meanwhile only notes its signal, which is raised again on this processor once it is done.
+static void MachineHoldSignals(void){
+    MachineHoldDepth = MachineHoldDepth + 1;
+    __asm__ __volatile__("" ::: "memory");
+}
+
+static void MachineReleaseSignals(void){
+    __asm__ __volatile__("" ::: "memory");
+    MachineHoldDepth = MachineHoldDepth - 1;
+    __asm__ __volatile__("" ::: "memory");
+    if(!MachineHoldDepth && MachineHeldSignals){
+        int Held = __sync_lock_test_and_set(&MachineHeldSignals, 0);
+        
+        for(int Signal = 1; Held; Signal++){
+            if(Held & (1 << Signal)){
+                Held &= ~(1 << Signal);
+                raise(Signal);
+            }
+        }
+    }
+}
+
+// Called first thing in a handler, returns true if the processor is holding signals off and the handler must return
+static bool MachineSignalHeld(int signum){
+    if(!MachineHoldDepth){
+        return false;
+    }
+    __sync_fetch_and_or(&MachineHeldSignals, 1 << signum);
+    return true;
+}
+
+// Requests can be added from any processor. A handler that switched threads away from the holder could deadlock
+// the processor, so signals are held off while the lock is.
+static void MachineLockPending(void){
+    MachineHoldSignals();
+    while(__sync_lock_test_and_set(&MachinePendingLock, 1)){
+        sched_yield();
+    }
+}
+
+static void MachineUnlockPending(void){
+    __sync_lock_release(&MachinePendingLock);
+    MachineReleaseSignals();
+}
+
+#if defined(MACHINE_CONTEXT_X86_64)
+
+#define MACHINE_CONTEXT_INITIAL_MXCSR   0x1F80
+#define MACHINE_CONTEXT_INITIAL_FPUCW   0x037F
+
+void MachineContextSwitchX86_64(void **oldsp, void *newsp);
+void MachineContextBootX86_64(void);
+
+// Saves the callee saved registers plus the SSE/x87 control words on the old 
+// stack, stores the old stack pointer and pops the same frame off the new stack. 
+// The boot stub is where a freshly created context "returns" to, with the entry 
+// point in r12, its parameter in r13 and the function to call if it returns in r14. 
+__asm__(
+    ".text\n"
+    ".globl MachineContextSwitchX86_64\n"
+    ".hidden MachineContextSwitchX86_64\n"
+    ".type MachineContextSwitchX86_64, @function\n"
+    "MachineContextSwitchX86_64:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size MachineContextSwitchX86_64, .-MachineContextSwitchX86_64\n"
+    ".globl MachineContextBootX86_64\n"
+    ".hidden MachineContextBootX86_64\n"
+    ".type MachineContextBootX86_64, @function\n"
+    "MachineContextBootX86_64:\n"
+    "    movq %r13, %rdi\n"
+    "    andq $-16, %rsp\n"
+    "    callq *%r12\n"
+    "    callq *%r14\n"
+    "    ud2\n"
+    ".size MachineContextBootX86_64, .-MachineContextBootX86_64\n"
+);
+
+void MachineContextSwitch(SMachineContextRef mcntxold, SMachineContextRef mcntxnew){
+    if(mcntxold != mcntxnew){
+        MachineContextSwitchX86_64(&mcntxold->DStackPointer, mcntxnew->DStackPointer);
+    }
+}
+
+void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+    uint64_t *StackTop = (uint64_t *)(((uintptr_t)stackaddr + stacksize) & ~(uintptr_t)15);
+    uint64_t *Frame = StackTop - 8;
+    
+    // Frame matches what MachineContextSwitchX86_64 pops, lowest address first 
+    Frame[0] = MACHINE_CONTEXT_INITIAL_MXCSR | ((uint64_t)MACHINE_CONTEXT_INITIAL_FPUCW << 32);
+    Frame[1] = 0;                                   // r15
+    Frame[2] = (uint64_t)(uintptr_t)abort;          // r14
+    Frame[3] = (uint64_t)(uintptr_t)param;          // r13
+    Frame[4] = (uint64_t)(uintptr_t)entry;          // r12
+    Frame[5] = 0;                                   // rbx
+    Frame[6] = 0;                                   // rbp
+    Frame[7] = (uint64_t)(uintptr_t)MachineContextBootX86_64;
+    mcntxref->DStackPointer = Frame;
+}
+
+#elif defined(MACHINE_CONTEXT_UCONTEXT)
+
+// A suspended context keeps its ucontext_t on its own stack so that the 
+// SMachineContext can be copied or moved without breaking the internal pointers 
+// glibc keeps inside ucontext_t. New contexts carve theirs off the top of the stack. 
+void MachineContextSwitch(SMachineContextRef mcntxold, SMachineContextRef mcntxnew){
+    ucontext_t Context;
+    
+    if(mcntxold != mcntxnew){
+        mcntxold->DUserContext = &Context;
+        swapcontext(&Context, mcntxnew->DUserContext);
+    }
+}
+
+void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+    uintptr_t StackTop = ((uintptr_t)stackaddr + stacksize - sizeof(ucontext_t)) & ~(uintptr_t)63;
+    ucontext_t *Context = (ucontext_t *)StackTop;
+    
+    getcontext(Context);
+    Context->uc_stack.ss_sp = stackaddr;
+    Context->uc_stack.ss_size = StackTop - (uintptr_t)stackaddr;
+    Context->uc_link = NULL;
+    makecontext(Context, (void (*)(void))entry, 1, param);
+    mcntxref->DUserContext = Context;
+}
+
+#else
 
 void MachineContextCreateTrampoline(int sig);
 void MachineContextCreateBoot(void);
@@ -172,36 +368,7 @@ void MachineContextCreateBoot(void){
     abort();
 }
 
-int MachineGetInt(uint8_t *ptr){
-    int Value = 0;
-    for(size_t Index = 0; Index < sizeof(int); Index++){
-        Value <<= 8;
-        Value |= ptr[Index];
-    }
-    return Value;
-}
-
-uint8_t *MachineGetPointer(uint8_t *ptr){
-    uint8_t *Value = (uint8_t *)0;
-    uint8_t *Dest = (uint8_t *)&Value;
-    for(size_t Index = 0; Index < sizeof(uint8_t *); Index++){
-        Dest[Index] = ptr[Index];
-    }
-    return Value;
-}
-
-void MachineSetInt(uint8_t *ptr, int val){
-    for(size_t Index = 0; Index < sizeof(int); Index++){
-        ptr[Index] = (val>>((sizeof(int) - Index - 1) * 8));
-    }
-}
-
-void MachineSetPointer(uint8_t *ptr, uint8_t *val){
-    uint8_t *Source = (uint8_t *)&val;
-    for(size_t Index = 0; Index < sizeof(uint8_t *); Index++){
-        ptr[Index] = Source[Index];//(val>>((sizeof(int) - Index - 1) * 8));
-    }
-}
+#endif
 
 bool MachineValidSharePointer(uint8_t *ptr){
     if(ptr < MachineData.DSharedBase){
@@ -213,48 +380,176 @@ bool MachineValidSharePointer(uint8_t *ptr){
     return true;
 }
 
+// A transfer can be as large as the shared region, as long as all of it lies inside
+bool MachineValidShareRange(uint8_t *ptr, int length){
+    if(!MachineValidSharePointer(ptr) || (0 > length)){
+        return false;
+    }
+    return (size_t)length <= (size_t)(MachineData.DSharedBase + MachineData.DSharedSize - ptr);
+}
+
 void MachineRequestSignalHandler(int signum){
     uint8_t TempByte = 0;
     write(MachineSignalPipe[1],&TempByte, 1);
 }
 
-void MachineReplySignalHandler(int signum){
-    uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-    SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
-    ssize_t MessageSize;
+bool MachineRingEmpty(SMachineRingIndexRef index){
+    return index->DHead == index->DTail;
+}
+
+// Publishes the entry the producer just filled in
+void MachineRingPublish(SMachineRingIndexRef index){
+    __sync_synchronize();
+    index->DTail = index->DTail + 1;
+    __sync_synchronize();
+}
 
+// Wakes the consumer with signum if it asked to be and there is something for it
+void MachineRingNotify(SMachineRingIndexRef index, pid_t consumer, int signum){
+    if(index->DArmed && !MachineRingEmpty(index) && __sync_lock_test_and_set(&index->DArmed, 0)){
+        kill(consumer, signum);
+    }
+}
+
+// Asks the producer for a signal with the next entry. Returns false if an entry came in meanwhile, in which case
+// the consumer should take it rather than wait for the signal.
+bool MachineRingArm(SMachineRingIndexRef index){
+    index->DArmed = 1;
+    __sync_synchronize();
+    return MachineRingEmpty(index);
+}
+
+// The child cleared the parent's arm when it sent the signal, so it queues completions without signalling until
+// the ring is drained and armed again. Other signals are held off until then, so nothing switches threads away
+// with completions left in the ring. The reply done callback gets to do that once the ring is empty.
+void MachineReplySignalHandler(int signum){
+    SMachineRingIndexRef Index = &MachineData.DRings->DCompleteIndex;
+    
+    if(MachineSignalHeld(signum)){
+        return;
+    }
+    MachineHoldSignals();
     do{
-        MessageSize = msgrcv(MachineData.DReplyChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
-        if(0 < MessageSize){
-            if(MachinePendingCallbacks.end() != MachinePendingCallbacks.find(MessageRef->DRequestID)){
-                SMachinePendingCallback Callinfo = MachinePendingCallbacks[MessageRef->DRequestID];
-                int ReturnValue = MachineGetInt(MessageRef->DPayload);
-                MachinePendingCallbacks.erase(MessageRef->DRequestID);
-                Callinfo.DCallback(Callinfo.DCalldata, ReturnValue);
+        while(true){
+            SMachineCompletion Completion;
+            SMachinePendingCallback Callinfo;
+            bool Found = false;
+            
+            MachineLockPending();
+            if(MachineRingEmpty(Index)){
+                MachineUnlockPending();
+                break;
+            }
+            __sync_synchronize();
+            Completion = MachineData.DRings->DCompletions[Index->DHead % MACHINE_COMPLETE_ENTRIES];
+            __sync_synchronize();
+            Index->DHead = Index->DHead + 1;
+            if(MachinePendingCallbacks.end() != MachinePendingCallbacks.find(Completion.DRequestID)){
+                Callinfo = MachinePendingCallbacks[Completion.DRequestID];
+                MachinePendingCallbacks.erase(Completion.DRequestID);
+                Found = true;
+            }
+            MachineUnlockPending();
+            if(Found){
+                Callinfo.DCallback(Callinfo.DCalldata, Completion.DResult);
             }
             else{
-                fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",MessageRef->DRequestID);
+                fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",Completion.DRequestID);
             }
         }
-    }while(0 < MessageSize);
-    
-    
+    }while(!MachineRingArm(Index));
+    MachineReleaseSignals();
+    if(MachineReplyDoneCallback){
+        MachineReplyDoneCallback(MachineReplyDoneCalldata);
+    }
+}
+
+void MachineRequestReplyDone(TMachineAlarmCallback callback, void *calldata){
+    MachineReplyDoneCallback = callback;
+    MachineReplyDoneCalldata = calldata;
 }
 
-uint32_t MachineAddRequest(TMachineFileCallback callback, void *calldata){
+// Queues a request for the child. If the ring is full the child is woken and given the chance to drain it.
+void MachineSubmit(SMachineSubmissionRef submission, TMachineFileCallback callback, void *calldata){
+    SMachineRingIndexRef Index = &MachineData.DRings->DSubmitIndex;
     SMachinePendingCallback Callback;
     
     Callback.DCallback = callback;
     Callback.DCalldata = calldata;
     
-    MachineRequestID++;
-    MachinePendingCallbacks[(uint32_t)MachineRequestID] = Callback;
-    return MachineRequestID;
+    MachineLockPending();
+    while(Index->DTail - Index->DHead >= MACHINE_SUBMIT_ENTRIES){
+        MachineUnlockPending();
+        kill(MachineData.DChildPID, SIGUSR2);
+        sched_yield();
+        MachineLockPending();
+    }
+    submission->DRequestID = ++MachineRequestID;
+    MachinePendingCallbacks[submission->DRequestID] = Callback;
+    MachineData.DRings->DSubmissions[Index->DTail % MACHINE_SUBMIT_ENTRIES] = *submission;
+    MachineRingPublish(Index);
+    if(!MachineBatchDepth){
+        MachineRingNotify(Index, MachineData.DChildPID, SIGUSR2);
+    }
+    MachineUnlockPending();
 }
 
-void MachineSendReply(SMachineRequestRef mess, int length){
-    msgsnd(MachineData.DReplyChannel, mess, length, 0);
-    kill(MachineData.DParentPID, SIGUSR2);
+void MachineFileBatchBegin(void){
+    MachineBatchDepth++;
+}
+
+void MachineFileBatchEnd(void){
+    if(MachineInitialized && !--MachineBatchDepth){
+        MachineRingNotify(&MachineData.DRings->DSubmitIndex, MachineData.DChildPID, SIGUSR2);
+    }
+}
+
+// Called by the child, which is the only producer of completions. The parent is only woken once the child has
+// gone through everything it can do for now, so completions that finish together arrive together.
+void MachineSendReply(uint32_t requestid, int result){
+    SMachineRingIndexRef Index = &MachineData.DRings->DCompleteIndex;
+    SMachineCompletionRef Completion;
+    
+    while(Index->DTail - Index->DHead >= MACHINE_COMPLETE_ENTRIES){
+        kill(MachineData.DParentPID, SIGUSR2);
+        sched_yield();
+    }
+    Completion = &MachineData.DRings->DCompletions[Index->DTail % MACHINE_COMPLETE_ENTRIES];
+    Completion->DRequestID = requestid;
+    Completion->DResult = result;
+    MachineRingPublish(Index);
+}
+
+// Called by the child, which is the only consumer of submissions
+bool MachinePopSubmission(SMachineSubmissionRef submission){
+    SMachineRingIndexRef Index = &MachineData.DRings->DSubmitIndex;
+    
+    if(MachineRingEmpty(Index)){
+        return false;
+    }
+    __sync_synchronize();
+    *submission = MachineData.DRings->DSubmissions[Index->DHead % MACHINE_SUBMIT_ENTRIES];
+    __sync_synchronize();
+    Index->DHead = Index->DHead + 1;
+    return true;
+}
+
+// Called by the child. A chained read only goes ahead if the transfer before it on the same descriptor moved
+// everything it asked for, so the chained reads at the head of fd's queue are completed with 0 once one comes up
+// short, the same as if they had never been issued.
+void MachineSkipChainedReads(std::vector< SMachinePendingRead > &pendingreads, std::map< int, bool > &shortfds, int fd){
+    size_t ReadIndex = 0;
+    
+    while(shortfds[fd]){
+        while((ReadIndex < pendingreads.size())&&(pendingreads[ReadIndex].DFileDescriptor != fd)){
+            ReadIndex++;
+        }
+        if((ReadIndex == pendingreads.size())||(!pendingreads[ReadIndex].DChained)){
+            break;
+        }
+        MachineSendReply(pendingreads[ReadIndex].DRequestID, 0);
+        pendingreads.erase(pendingreads.begin() + ReadIndex);
+    }
 }
 
 void *MachineInitialize(size_t sharesize){
@@ -262,6 +557,7 @@ void *MachineInitialize(size_t sharesize){
     struct sigaction OldSigAction, SigAction;
     uint8_t TempPage[MACHINE_PAGE_SIZE];
     int PageCount = ((sizeof(TempPage) - 1) + sharesize)/sizeof(TempPage);
+    int RingPageCount = ((sizeof(TempPage) - 1) + sizeof(SMachineRings))/sizeof(TempPage);
     
     if(MachineInitialized){
         return NULL;
@@ -269,38 +565,27 @@ void *MachineInitialize(size_t sharesize){
     
     sigaction(SIGALRM, NULL, &MachineAlarmActionSave);
     MachineData.DParentPID = getpid();
-    MachineData.DRequestChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if(0 > MachineData.DRequestChannel){
-        fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
-        exit(1);
-    }
-    MachineData.DReplyChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if(0 > MachineData.DReplyChannel){
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
-        exit(1);
-    }
     MachineData.DMMapFile = open("./vm_shmem", O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
     if(0 > MachineData.DMMapFile){
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
         fprintf(stderr,"Failed to create shared memory file: %s\n", strerror(errno));
         exit(1);
     }
     memset(TempPage,0,sizeof(TempPage));
-    for(int Index = 0; Index < PageCount; Index++){
+    for(int Index = 0; Index < PageCount + RingPageCount; Index++){
         write(MachineData.DMMapFile,TempPage,sizeof(TempPage));   
     }
     MachineData.DSharedSize = sizeof(TempPage) * PageCount;
-    MachineData.DSharedBase = (uint8_t *)mmap(NULL, MachineData.DSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, MachineData.DMMapFile, 0);
+    MachineData.DSharedBase = (uint8_t *)mmap(NULL, MachineData.DSharedSize + sizeof(TempPage) * RingPageCount, PROT_READ | PROT_WRITE, MAP_SHARED, MachineData.DMMapFile, 0);
     if(MAP_FAILED == MachineData.DSharedBase){
         close(MachineData.DMMapFile);
         unlink("./vm_shmem");
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
         fprintf(stderr,"Failed to map shared memory file: %s\n", strerror(errno));
         exit(1);
     }
+    // The rings sit past the space handed out, the file is zero filled so both start empty. The parent starts out
+    // armed since it can take a completion signal at any time.
+    MachineData.DRings = (SMachineRingsRef)(MachineData.DSharedBase + MachineData.DSharedSize);
+    MachineData.DRings->DCompleteIndex.DArmed = 1;
     
     
     MachineSuspendSignals(&SigStateSave);
@@ -310,13 +595,9 @@ void *MachineInitialize(size_t sharesize){
         bool Terminated = false;
         std::vector< struct pollfd > PollFDs;
         std::vector< SMachinePendingRead > PendingReads;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
-        ssize_t MessageSize;
-        sigset_t SigMask;
-        int Result, FileDescriptor, Length, Flags, Mode;
-        int Offset, Whence;
-        uint8_t *BufferPointer;
+        std::map< int, bool > ShortFDs; // Whether the last read or write on a descriptor came up short
+        SMachineSubmission Submission;
+        int Result, FileDescriptor;
         
         MachineData.DChildPID = getpid();
         pipe(MachineSignalPipe);
@@ -330,95 +611,91 @@ void *MachineInitialize(size_t sharesize){
         sigaction(SIGUSR2, &SigAction, &OldSigAction);
         MachineEnableSignals();
         while(!Terminated){
-            sigemptyset(&SigMask);
+            bool Waiting = MachineRingArm(&MachineData.DRings->DSubmitIndex);
+            
             PollFDs[0].events = POLLIN;
             PollFDs[0].revents = 0;
-            Result = poll(PollFDs.data(), PollFDs.size(), 1);
+            // Only sleep when there is nothing submitted, the parent signals once it sees the ring is armed
+            Result = poll(PollFDs.data(), PollFDs.size(), Waiting ? 1 : 0);
+            MachineData.DRings->DSubmitIndex.DArmed = 0;
             if((0 < Result)&&(PollFDs[0].revents)){
-                SMachinePendingRead PendingRead;
-                bool Found;
-                uint8_t TempByte;
-
-                read(PollFDs[0].fd, &TempByte, 1);
-                while(true){
-                    MessageSize = msgrcv(MachineData.DRequestChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
-                    if(0 < MessageSize){
-                        switch(MessageRef->DType){
-                            case MACHINE_REQUEST_NONE:          break;
-                            case MACHINE_REQUEST_OPEN:          Flags = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + 1);
-                                                                Mode = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + sizeof(int) + 1);
-                                                                FileDescriptor = open((char *)MessageRef->DPayload, Flags, Mode);
-                                                                MachineSetInt(MessageRef->DPayload, FileDescriptor);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_READ:          PendingRead.DRequestID = MessageRef->DRequestID;
-                                                                PendingRead.DFileDescriptor = MachineGetInt(MessageRef->DPayload);
-                                                                PendingRead.DLength = MachineGetInt(MessageRef->DPayload + sizeof(int));
-                                                                PendingRead.DBuffer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
-                                                                if(MachineValidSharePointer(PendingRead.DBuffer) && (PendingRead.DLength <= MACHINE_MAX_TRANSFER_SIZE)){
-                                                                    Found = false;
-                                                                    for(size_t Index = 0; Index < PollFDs.size(); Index++){
-                                                                        if(PollFDs[Index].fd == PendingRead.DFileDescriptor){
-                                                                            Found = true;
-                                                                            break;
-                                                                        }
-                                                                    }
-                                                                    if(!Found){
-                                                                        struct pollfd NewReadFD;
-                                                                        
-                                                                        NewReadFD.fd = PendingRead.DFileDescriptor;
-                                                                        NewReadFD.events = POLLIN;
-                                                                        NewReadFD.revents = 0;
-                                                                        PollFDs.push_back(NewReadFD);
-                                                                    }
-                                                                    PendingReads.push_back(PendingRead);
-                                                                }
-                                                                else{
-                                                                    MachineSetInt(MessageRef->DPayload, -1);
-                                                                    MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1); 
-                                                                }
-                                                                break;
-                            case MACHINE_REQUEST_WRITE:         FileDescriptor = MachineGetInt(MessageRef->DPayload);
-                                                                Length = MachineGetInt(MessageRef->DPayload + sizeof(int));
-                                                                BufferPointer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
-                                                                if(MachineValidSharePointer(BufferPointer) && (Length <= MACHINE_MAX_TRANSFER_SIZE)){
-                                                                    do{
-                                                                        Result = write(FileDescriptor, BufferPointer, Length);
-                                                                    }while((-1 == Result) && (EINTR == errno));
-                                                                    MachineSetInt(MessageRef->DPayload, Result);
-                                                                }
-                                                                else{
-                                                                    MachineSetInt(MessageRef->DPayload, -1);
-                                                                }
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_SEEK:          FileDescriptor = MachineGetInt(MessageRef->DPayload);
-                                                                Offset = MachineGetInt(MessageRef->DPayload + sizeof(int));
-                                                                Whence = MachineGetInt(MessageRef->DPayload + sizeof(int) * 2);
-                                                                Offset = lseek(FileDescriptor, Offset, Whence);
-                                                                MachineSetInt(MessageRef->DPayload, Offset);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_CLOSE:         FileDescriptor = close(MachineGetInt(MessageRef->DPayload));
-                                                                MachineSetInt(MessageRef->DPayload, FileDescriptor);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_TERMINATE:     Terminated = true;
-                            default:                            break;
-                        }
-                    }
-                    else{
-                        break;   
-                    }   
-                }
+                uint8_t TempBytes[64];
+
+                read(PollFDs[0].fd, TempBytes, sizeof(TempBytes));
             }
-            else if(0 == Result){
+            else if((0 == Result)&&Waiting){
                 if(0 > kill(MachineData.DParentPID, 0)){
                     if(ESRCH == errno){
                         Terminated = true;
                     }
                 }
             }
+            while(MachinePopSubmission(&Submission)){
+                switch(Submission.DType){
+                    case MACHINE_REQUEST_NONE:          break;
+                    case MACHINE_REQUEST_OPEN:          if(0 > Submission.DLength){
+                                                            MachineSendReply(Submission.DRequestID, -1);
+                                                            break;
+                                                        }
+                                                        FileDescriptor = open(Submission.DFileName, Submission.DLength, Submission.DMode);
+                                                        MachineSendReply(Submission.DRequestID, FileDescriptor);
+                                                        break;
+                    case MACHINE_REQUEST_READ:          if(MachineValidShareRange(Submission.DBuffer, Submission.DLength)){
+                                                            SMachinePendingRead PendingRead;
+                                                            bool Found = false;
+                                                            
+                                                            PendingRead.DRequestID = Submission.DRequestID;
+                                                            PendingRead.DFileDescriptor = Submission.DFileDescriptor;
+                                                            PendingRead.DLength = Submission.DLength;
+                                                            PendingRead.DBuffer = Submission.DBuffer;
+                                                            PendingRead.DChained = 0 != Submission.DMode;
+                                                            for(size_t Index = 0; Index < PollFDs.size(); Index++){
+                                                                if(PollFDs[Index].fd == PendingRead.DFileDescriptor){
+                                                                    Found = true;
+                                                                    break;
+                                                                }
+                                                            }
+                                                            if(!Found){
+                                                                struct pollfd NewReadFD;
+                                                                
+                                                                NewReadFD.fd = PendingRead.DFileDescriptor;
+                                                                NewReadFD.events = POLLIN;
+                                                                NewReadFD.revents = 0;
+                                                                PollFDs.push_back(NewReadFD);
+                                                            }
+                                                            PendingReads.push_back(PendingRead);
+                                                            MachineSkipChainedReads(PendingReads, ShortFDs, PendingRead.DFileDescriptor);
+                                                        }
+                                                        else{
+                                                            MachineSendReply(Submission.DRequestID, -1);
+                                                        }
+                                                        break;
+                    case MACHINE_REQUEST_WRITE:         if(Submission.DMode && ShortFDs[Submission.DFileDescriptor]){
+                                                            MachineSendReply(Submission.DRequestID, 0);
+                                                            break;
+                                                        }
+                                                        if(MachineValidShareRange(Submission.DBuffer, Submission.DLength)){
+                                                            do{
+                                                                Result = write(Submission.DFileDescriptor, Submission.DBuffer, Submission.DLength);
+                                                            }while((-1 == Result) && (EINTR == errno));
+                                                        }
+                                                        else{
+                                                            Result = -1;
+                                                        }
+                                                        ShortFDs[Submission.DFileDescriptor] = Result != Submission.DLength;
+                                                        MachineSendReply(Submission.DRequestID, Result);
+                                                        break;
+                    case MACHINE_REQUEST_SEEK:          Result = lseek(Submission.DFileDescriptor, Submission.DLength, Submission.DMode);
+                                                        MachineSendReply(Submission.DRequestID, Result);
+                                                        break;
+                    case MACHINE_REQUEST_CLOSE:         Result = close(Submission.DFileDescriptor);
+                                                        ShortFDs.erase(Submission.DFileDescriptor);
+                                                        MachineSendReply(Submission.DRequestID, Result);
+                                                        break;
+                    case MACHINE_REQUEST_TERMINATE:     Terminated = true;
+                    default:                            break;
+                }
+            }
             for(size_t Index = 1; Index < PollFDs.size(); Index++){
                 if(PollFDs[Index].revents){
                     for(size_t ReadIndex = 0; ReadIndex < PendingReads.size(); ReadIndex++){
@@ -426,10 +703,10 @@ void *MachineInitialize(size_t sharesize){
                             do{
                                 Result = read(PendingReads[ReadIndex].DFileDescriptor, PendingReads[ReadIndex].DBuffer, PendingReads[ReadIndex].DLength);
                             }while((-1 == Result) && (EINTR == errno));
-                            MessageRef->DRequestID = PendingReads[ReadIndex].DRequestID;
-                            MachineSetInt(MessageRef->DPayload, Result);
-                            MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
+                            ShortFDs[PollFDs[Index].fd] = Result != PendingReads[ReadIndex].DLength;
+                            MachineSendReply(PendingReads[ReadIndex].DRequestID, Result);
                             PendingReads.erase(PendingReads.begin() + ReadIndex);
+                            MachineSkipChainedReads(PendingReads, ShortFDs, PollFDs[Index].fd);
                             break;
                         }
                     }
@@ -449,9 +726,8 @@ void *MachineInitialize(size_t sharesize){
                     PollFDs.erase(PollFDs.begin() + Index);
                 }
             }
+            MachineRingNotify(&MachineData.DRings->DCompleteIndex, MachineData.DParentPID, SIGUSR2);
         }
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
         close(MachineData.DMMapFile);
         unlink("./vm_shmem");
         sigaction(SIGUSR2, &OldSigAction, NULL);
@@ -472,20 +748,17 @@ void *MachineInitialize(size_t sharesize){
 void MachineTerminate(void){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSubmission Submission;
         int Status;
         
         MachineSuspendSignals(&SignalState);
         
         sigaction(SIGALRM, &MachineAlarmActionSave, NULL);
         
-        MessageRef->DType = MACHINE_REQUEST_TERMINATE;
+        Submission.DType = MACHINE_REQUEST_TERMINATE;
         ualarm(0,0);
-        MessageRef->DRequestID = MachineAddRequest(NULL, NULL);
         close(MachineData.DMMapFile);
-        Status = msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        MachineSubmit(&Submission, NULL, NULL);
         wait(&Status);
         MachineResumeSignals(&SignalState);
     }
@@ -511,11 +784,71 @@ void MachineResumeSignals(TMachineSignalStateRef sigstate){
 }
 
 void MachineAlarmSignalHandler(int signum){
+    if(MachineSignalHeld(signum)){
+        return;
+    }
     if(MachineAlarmCallback){
         MachineAlarmCallback(MachineAlarmCalldata); 
     }
 }
 
+static void *MachineProcessorThread(void *param){
+    SMachineProcessorStartRef Start = (SMachineProcessorStartRef)param;
+    
+    Start->DEntry(Start->DProcessor, Start->DCalldata);
+    return NULL;
+}
+
+void MachineStartProcessors(int count, TMachineProcessorEntry entry, void *calldata){
+    TMachineSignalState SignalState;
+    SMachineProcessorStartRef Starts;
+    
+    if(1 >= count){
+        return;
+    }
+    // New processors inherit the mask, so they start with every signal blocked
+    MachineSuspendSignals(&SignalState);
+    MachineProcessors.resize(count);
+    MachineProcessors[0] = pthread_self();
+    Starts = new SMachineProcessorStart[count];
+    for(int Index = 1; Index < count; Index++){
+        Starts[Index].DEntry = entry;
+        Starts[Index].DCalldata = calldata;
+        Starts[Index].DProcessor = Index;
+        if(0 != pthread_create(&MachineProcessors[Index], NULL, MachineProcessorThread, &Starts[Index])){
+            fprintf(stderr,"Failed to start processor %d: %s\n", Index, strerror(errno));
+            exit(1);
+        }
+    }
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineKickSignalHandler(int signum){
+    if(MachineSignalHeld(signum)){
+        return;
+    }
+    if(MachineKickCallback){
+        MachineKickCallback(MachineKickCalldata); 
+    }
+}
+
+void MachineRequestKick(TMachineAlarmCallback callback, void *calldata){
+    struct sigaction NewAction;
+    
+    memset((void *)&NewAction, 0, sizeof(struct sigaction));
+    NewAction.sa_handler = MachineKickSignalHandler;
+    sigemptyset(&NewAction.sa_mask);
+    MachineKickCallback = callback;
+    MachineKickCalldata = calldata;
+    sigaction(MACHINE_KICK_SIGNAL, &NewAction, NULL);
+}
+
+void MachineKickProcessor(int processor){
+    if((0 <= processor)&&(processor < (int)MachineProcessors.size())){
+        pthread_kill(MachineProcessors[processor], MACHINE_KICK_SIGNAL);
+    }
+}
+
 void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *calldata){
     if(MachineInitialized){
         struct sigaction NewAction;
@@ -533,96 +866,95 @@ void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *
     }
 }
 
-void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata){
+void MachineRescheduleAlarm(uint64_t usec, useconds_t interval){
     if(MachineInitialized){
-        TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        struct itimerval Timer;
         
-        MessageRef->DType = MACHINE_REQUEST_OPEN;
-        strcpy((char *)MessageRef->DPayload, filename);
-        MachineSetInt(MessageRef->DPayload + strlen(filename) + 1, flags);
-        MachineSetInt(MessageRef->DPayload + strlen(filename) + sizeof(int) + 1, mode);
-        
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + strlen(filename) + sizeof(int), 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        Timer.it_value.tv_sec = usec / 1000000;
+        Timer.it_value.tv_usec = usec % 1000000;
+        Timer.it_interval.tv_sec = interval / 1000000;
+        Timer.it_interval.tv_usec = interval % 1000000;
+        setitimer(ITIMER_REAL, &Timer, NULL);
     }
 }
 
-void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+void MachineWaitSignals(void){
+    sigset_t EmptySigset;
+    
+    sigemptyset(&EmptySigset);
+    sigsuspend(&EmptySigset);
+}
+
+void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
-        TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSubmission Submission;
         
-        MessageRef->DType = MACHINE_REQUEST_READ;
-        MachineSetInt(MessageRef->DPayload, fd);
-        MachineSetInt(MessageRef->DPayload + sizeof(int), length);
-        MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
+        Submission.DType = MACHINE_REQUEST_OPEN;
+        Submission.DLength = flags;
+        Submission.DMode = mode;
+        if(sizeof(Submission.DFileName) > strlen(filename)){
+            strcpy(Submission.DFileName, filename);
+        }
+        else{
+            // Too long to fit the record, the child fails it like open would
+            Submission.DLength = -1;
+        }
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineSubmit(&Submission, callback, calldata);
     }
 }
 
-void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+void MachineFileTransfer(int type, int fd, void *data, int length, bool chained, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
-        TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSubmission Submission;
         
-        MessageRef->DType = MACHINE_REQUEST_WRITE;
-        MachineSetInt(MessageRef->DPayload, fd);
-        MachineSetInt(MessageRef->DPayload + sizeof(int), length);
-        MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
+        Submission.DType = type;
+        Submission.DFileDescriptor = fd;
+        Submission.DLength = length;
+        Submission.DMode = chained;
+        Submission.DBuffer = (uint8_t *)data;
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineSubmit(&Submission, callback, calldata);
     }
 }
 
+void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_READ, fd, data, length, false, callback, calldata);
+}
+
+void MachineFileReadChained(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_READ, fd, data, length, true, callback, calldata);
+}
+
+void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_WRITE, fd, data, length, false, callback, calldata);
+}
+
+void MachineFileWriteChained(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_WRITE, fd, data, length, true, callback, calldata);
+}
+
 void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
-        TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSubmission Submission;
         
-        MessageRef->DType = MACHINE_REQUEST_SEEK;
-        MachineSetInt(MessageRef->DPayload, fd);
-        MachineSetInt(MessageRef->DPayload + sizeof(int), offset);
-        MachineSetInt(MessageRef->DPayload + sizeof(int) * 2, whence);
+        Submission.DType = MACHINE_REQUEST_SEEK;
+        Submission.DFileDescriptor = fd;
+        Submission.DLength = offset;
+        Submission.DMode = whence;
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 3 * sizeof(int) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineSubmit(&Submission, callback, calldata);
     }
 }
 
 void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
-        TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSubmission Submission;
         
-        MessageRef->DType = MACHINE_REQUEST_CLOSE;
-        MachineSetInt(MessageRef->DPayload, fd);
+        Submission.DType = MACHINE_REQUEST_CLOSE;
+        Submission.DFileDescriptor = fd;
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + sizeof(int) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineSubmit(&Submission, callback, calldata);
     }
 }
 
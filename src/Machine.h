@@ -10,10 +10,32 @@ extern "C" {
 #include <unistd.h>
 #include <stdint.h>
 
+// Context implementation: hand written x86-64 switch by default, ucontext on other 
+// architectures, or the original setjmp/longjmp with a SIGUSR1 trampoline when 
+// MACHINE_CONTEXT_SIGNAL is defined 
+#if !defined(MACHINE_CONTEXT_SIGNAL) && !defined(MACHINE_CONTEXT_UCONTEXT)
+#if defined(__x86_64__)
+#define MACHINE_CONTEXT_X86_64
+#else
+#define MACHINE_CONTEXT_UCONTEXT
+#endif
+#endif
+
+#ifdef MACHINE_CONTEXT_UCONTEXT
+#include <ucontext.h>
+#endif
+
 typedef struct{
+#if defined(MACHINE_CONTEXT_X86_64)
+    void *DStackPointer;
+#elif defined(MACHINE_CONTEXT_UCONTEXT)
+    ucontext_t *DUserContext;
+#else
     jmp_buf DJumpBuffer;
+#endif
 } SMachineContext, *SMachineContextRef;
 
+#ifdef MACHINE_CONTEXT_SIGNAL
 // save machine context 
 #define MachineContextSave(mcntx)                   \
     setjmp((mcntx)->DJumpBuffer)
@@ -25,12 +47,17 @@ typedef struct{
 // switch machine context 
 #define MachineContextSwitch(mcntxold,mcntxnew)    \
     if(setjmp((mcntxold)->DJumpBuffer) == 0) longjmp((mcntxnew)->DJumpBuffer, 1)
+#else
+// switch machine context, only callee saved state is kept and the signal mask is left alone 
+void MachineContextSwitch(SMachineContextRef mcntxold, SMachineContextRef mcntxnew);
+#endif
 
 // create machine context 
 void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize);
 
 typedef void (*TMachineAlarmCallback)(void *calldata);
 typedef void (*TMachineFileCallback)(void *calldata, int result);
+typedef void (*TMachineProcessorEntry)(int processor, void *calldata);
 typedef sigset_t TMachineSignalState, *TMachineSignalStateRef;
 void *MachineInitialize(size_t sharesize);
 void MachineTerminate(void);
@@ -38,9 +65,27 @@ void MachineEnableSignals(void);
 void MachineSuspendSignals(TMachineSignalStateRef sigstate);
 void MachineResumeSignals(TMachineSignalStateRef sigstate);
 void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *calldata);
+void MachineRescheduleAlarm(uint64_t usec, useconds_t interval);
+void MachineWaitSignals(void);
+
+// Additional OS threads, processor 0 is the caller. A kick interrupts a processor with the kick callback
+void MachineStartProcessors(int count, TMachineProcessorEntry entry, void *calldata);
+void MachineRequestKick(TMachineAlarmCallback callback, void *calldata);
+void MachineKickProcessor(int processor);
+// File callbacks for the completions that came in together are called back to back and must not switch contexts,
+// the reply done callback is called once they have all been and may
+void MachineRequestReplyDone(TMachineAlarmCallback callback, void *calldata);
+// Requests the child can have queued at once, a request made while this many are outstanding waits for room
+#define MACHINE_MAX_REQUESTS            256
 void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata);
 void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
 void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
+// Only carried out if the read or write before it on fd moved everything it asked for, otherwise completes with 0
+void MachineFileReadChained(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
+void MachineFileWriteChained(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
+// Requests made between these reach the child together when the outermost batch ends
+void MachineFileBatchBegin(void);
+void MachineFileBatchEnd(void);
 void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata);
 void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata);
 
@@ -5,18 +5,41 @@
 #include <iostream>
 #include <fcntl.h>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 using namespace std;
 
 extern "C" {
 TVMMainEntry VMLoadModule(const char *module);
+int VMModuleSingleWorker(void);
 void VMUnloadModule(void);
+
+int VMOptionTickless = 0; //Set by the -n flag in main.c, stops the alarm while only the idle thread can run
+int VMOptionPriorityInheritance = 0; //Set by the -p flag in main.c, mutex owners inherit the priority of their waiters
+int VMOptionWorkers = 1; //Set by the -w flag in main.c, number of OS threads running VM threads
+int VMOptionHugePages = 0; //Set by the -l flag in main.c, backs the system heap with huge pages
 }
 
+#define VM_QUEUE_LEVELS                         (VM_THREAD_PRIORITY_HIGH + 1)
+
+/* A priority ordered queue of threads. Each level is a doubly linked list threaded through the TCBs and
+ * the bitmap has bit n set when level n is non-empty, so push, pop and remove are all O(1).*/
+typedef struct{
+    TVMThreadID head[VM_QUEUE_LEVELS];
+    TVMThreadID tail[VM_QUEUE_LEVELS];
+    unsigned int bitmap;
+} ThreadQueue;
+
 typedef struct{
     TVMThreadID id;
     void (*entry)(void *);
@@ -25,227 +48,1080 @@ typedef struct{
     size_t stacksize;
     SMachineContext cont;
     TVMThreadState state;
-    TVMThreadPriority prio;
+    TVMThreadPriority prio; //Effective priority, the one queues and the scheduler use
     int retVal;
-    int sleepTicks;
+    bool deleted; //Set while the slot is on the free list
+    TVMThreadID qNext; //Links for whichever ThreadQueue the thread is sitting in
+    TVMThreadID qPrev;
+    unsigned int qLevel; //Level the thread was queued at, 0 when it is not queued
+    TVMTick wakeTick; //Absolute tick a sleeping thread expires at
+    TVMThreadID tNext; //Links for the timer wheel slot the thread is sitting in
+    TVMThreadID tPrev;
+    int tSlot; //Timer wheel slot, -1 when the thread has no timer pending
+    int critDepth; //Critical section depth the thread was switched out with
+    int signalDepth; //Signal handlers active on the thread's stack, its signal mask isn't its own while nonzero
+    ThreadQueue *waitQueue; //Wait queue the thread is blocked on, NULL when it isn't blocked on one
+    bool waitTimedOut; //Set when the thread's last wait ended because its timeout expired
+    TVMThreadPriority basePrio; //Priority the thread was created with, prio is raised above it by inheritance
+    TVMMutexID waitMutex; //Mutex the thread is blocked acquiring, VM_MUTEX_ID_INVALID if none
+    ThreadQueue *queuedOn; //Ready or wait queue the thread is linked into, NULL when qLevel is 0
+    unsigned int generation; //Bumped each time the slot is deleted, so IDs handed out for the old thread go stale
+    void *stackAlloc; //System pool allocation the stack lives in, stackaddr is inside it past any guard page
+    TVMMemorySize stackClass; //Size of that allocation, freed stacks are cached by it
+    ThreadQueue joiners; //Threads blocked in VMThreadJoin on this one
+    int exitCode; //Set by VMThreadExit, 0 if the thread returned or was terminated
+    struct IOContext *io; //Records for the thread's requests to the machine, kept off its stack
 } TCB;
 
-TVMThreadID CurThreadID;
+#define VM_THREAD_SLOT_BITS                     16
+#define VM_THREAD_SLOT_MASK                     ((1 << VM_THREAD_SLOT_BITS) - 1)
+#define VM_THREAD_SLOT_LIMIT                    VM_THREAD_SLOT_MASK
+
+/* Thread IDs handed out by the API are the TCB slot in the low bits and the slot's generation above them, inside
+ * the VM threads are always referred to by slot. A deque never moves its elements when it grows, so the saved
+ * contexts and anything else pointing into a TCB stay put. Deleted slots go on the free list for reuse.*/
+deque<TCB> TCBList;
+vector<TVMThreadID> TCBFreeList;
+
+/* Threads that terminated a thread running on another worker, they wait here until it has been switched out so
+ * its stack can't be freed from under it.*/
+ThreadQueue SwitchOutWaiters;
+
+/*The ID the API hands out for a slot.*/
+TVMThreadID threadHandle(TVMThreadID slot){
+    return slot | ((TCBList[slot].generation & VM_THREAD_SLOT_MASK) << VM_THREAD_SLOT_BITS);
+}
+
+/*The slot an API thread ID refers to, VM_THREAD_ID_INVALID if it was never handed out or the thread is deleted.*/
+TVMThreadID threadSlot(TVMThreadID thread){
+    TVMThreadID slot = thread & VM_THREAD_SLOT_MASK;
+    if(slot >= TCBList.size() || TCBList[slot].deleted || threadHandle(slot) != thread){
+        return VM_THREAD_ID_INVALID;
+    }
+    return slot;
+}
+
+struct IOContext *ioContextCreate();
+
+/*Takes a slot off the free list, or adds one to the end of the table if there are none.*/
+TVMThreadID threadSlotAlloc(){
+    if(!TCBFreeList.empty()){
+        TVMThreadID slot = TCBFreeList.back();
+        TCBFreeList.pop_back();
+        return slot;
+    }
+    if(TCBList.size() >= VM_THREAD_SLOT_LIMIT){
+        return VM_THREAD_ID_INVALID;
+    }
+    TCBList.push_back(TCB());
+    TCBList.back().io = ioContextCreate();
+    return TCBList.size() - 1;
+}
 
-vector<TCB> TCBList;
+#define TIMER_ROOT_BITS                         8
+#define TIMER_LEVEL_BITS                        6
+#define TIMER_ROOT_SIZE                         (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE                        (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS                            4
+#define TIMER_SLOTS                             (TIMER_ROOT_SIZE + TIMER_LEVELS * TIMER_LEVEL_SIZE)
+#define TIMER_MAX_DELTA                         ((TVMTick)0x7FFFFFFF)
+
+/* Hierarchical timer wheel for sleeping threads, keyed by absolute expiry tick. The root wheel holds the next
+ * 256 ticks one slot per tick, and each outer level covers 64 times the span of the one below it. When the root
+ * wraps the matching outer slot is cascaded down, so a tick only touches the threads that actually expire.*/
+typedef struct{
+    TVMThreadID head[TIMER_SLOTS];
+    TVMTick now; //Last tick the wheel has been advanced to
+    unsigned int count; //Number of timers pending
+} TimerWheel;
+
+TimerWheel SleepWheel;
+
+#define VM_WORKER_IDLE_STACK_SIZE               0x40000
+
+/* One request to the machine, a whole open, seek or close or one piece of a transfer. A thread can keep several
+ * pieces in flight and only blocks when it needs the result of one that hasn't come back yet. The record lives
+ * in the requesting thread's IOContext until the request completes, so the completion is linked through it.*/
+typedef struct IOChunk{
+    TVMThreadID thread;
+    struct IOContext *context;
+    uint8_t *buffer; //Where the piece lands in or comes from in the shared space
+    int length;
+    int result;
+    bool done;
+    bool waiting; //Set while the thread is blocked on this piece
+    struct IOChunk *next; //Link in the worker's list of completions waiting to be replayed
+} IOChunk;
+
+/* Interrupts are disabled in software. While a worker's criticalDepth is nonzero the signal handlers only record
+ * that the alarm went off, a kick arrived or an IO finished and return, the work is replayed when the outermost
+ * critical section is left. Ticks and kicks are counted and IO completions are pushed onto a list linked through
+ * the requests themselves, so there is no limit on how many can pile up. Each has a single writer, and the replay
+ * takes the whole list in one exchange, so none of them needs the signals blocked to stay consistent.*/
+
+/* Each OS thread running VM threads is a worker with its own current thread, idle thread and ready queue.
+ * There is one unless -w asks for more. The VM lock is held by whichever worker is in a critical section, so
+ * shared state only ever has one worker touching it, and workers with nothing to run steal from the others.
+ * The ready queues are per worker but that one lock covers them all, so VM calls and scheduling on different
+ * workers still go one at a time, only thread code between VM calls runs side by side.*/
+typedef struct{
+    int index;
+    TVMThreadID curThread;
+    TVMThreadID idleThread;
+    ThreadQueue readyQueue;
+    volatile sig_atomic_t criticalDepth;
+    volatile unsigned int ticksRaised; //Only written by the alarm handler
+    volatile unsigned int ticksHandled; //Only written by the replay
+    volatile unsigned int kicksRaised; //Only written by the kick handler
+    volatile unsigned int kicksHandled; //Only written by the replay
+    IOChunk * volatile ioDone; //Completions the IO handler deferred, newest first
+    bool signalMaskDirty; //Set when a thread was switched out of a signal handler with the signals still blocked
+    SMachineContext bootCont; //Context of the OS thread the worker was started on, never resumed
+    volatile bool stopped; //Set once the worker has parked for shutdown
+} Worker;
+
+vector<Worker *> Workers;
+
+__thread Worker *LocalWorker;
+
+volatile int VMLock = 0;
+
+Worker * volatile VMStoppingWorker = NULL; //The worker VMMain returned on, every other worker parks once it is set
+
+/* A VM thread switched out on one worker may be resumed on another, so the worker has to be looked up again
+ * after anything that can switch. Keeping the TLS read out of line stops the compiler reusing it.*/
+__attribute__((noinline)) Worker *thisWorker(){
+    Worker *worker = LocalWorker;
+    __asm__ __volatile__("" : "+r"(worker));
+    return worker;
+}
 
-queue<TVMThreadID> HighPriorityQ;
-queue<TVMThreadID> MedPriorityQ;
-queue<TVMThreadID> LowPriorityQ;
+#define CurThreadID                             (thisWorker()->curThread)
 
-vector<TVMThreadID> SleepyThreads;
+bool ticklessIdle = false; //True while the periodic alarm is stopped for the idle thread
+uint64_t ticklessPhaseUS; //Time the current tick started at, used to keep ticks aligned across idle periods
 
 int tickCount;
 int tickDur; //How long a tick is
 
 const TVMMemoryPoolID VM_MEMORY_POOL_ID_SYSTEM = 1;
 
-unsigned int numPools = 2; //This will be used to assign pool identifiers
+#define VM_POOL_GRANULE                         64
+#define VM_POOL_BINS                            32
+#define VM_CHUNK_NONE                           ((unsigned int)-1)
+#define VM_POOL_ALIGN                           sizeof(void *)
+
+#define VM_ARENA_ALIGN                          16
 
+#define VM_POOL_KIND_GENERAL                    0
+#define VM_POOL_KIND_FIXED                      1
+#define VM_POOL_KIND_ARENA                      2
+#define VM_POOL_KIND_BUDDY                      3
+
+#define VM_BUDDY_MIN_ORDER                      6
+#define VM_BUDDY_ORDERS                         32
+#define VM_BUDDY_FREE                           0x80
+
+/* A bit per position, with a summary level above it holding a bit per word that isn't empty, and so on up to a
+ * single word, so the lowest set bit is found a word per level.*/
+typedef vector< vector<uint64_t> > BlockBitmap;
+
+/* A pool is carved into chunks that tile it in address order. Free chunks also sit on one of the pool's
+ * segregated free lists, bin n holding the chunks of 2^n up to 2^(n+1) granules, so finding a fit is a bitmap
+ * lookup instead of a walk over every chunk.*/
 typedef struct{
-    void *base;
+    void *base; //NULL while the record is spare
     TVMMemorySize size;
     bool free;
+    unsigned int prevChunk; //Chunk just below this one in memory, VM_CHUNK_NONE at the bottom of the pool
+    unsigned int nextChunk; //Chunk just above, VM_CHUNK_NONE at the top
+    unsigned int binPrev; //Links for the free list the chunk is on while free
+    unsigned int binNext;
 } MemoryChunk;
 
 typedef struct{
     TVMMemoryPoolID mpID;
+    unsigned int generation; //Bumped each time the slot is freed, so stale pool IDs stop matching
+    bool deleted;
+    unsigned int kind; //One of the VM_POOL_KIND_ values
     void *base;
     TVMMemorySize size;
-    vector<MemoryChunk> memList;
+    TVMMemorySize capacity; //Bytes the pool can hand out when empty
+    TVMMemorySize highWater; //Most bytes that have been allocated at once
+    vector<MemoryChunk> memList; //Chunk records, indexed by the links above and not kept in any order
+    vector<unsigned int> spareChunks; //Records in memList not describing a chunk right now
+    unsigned int bins[VM_POOL_BINS]; //Head of each free list
+    unsigned int binMap; //Bit n is set while bins[n] is not empty
+    TVMMemorySize freeBytes;
+    unordered_map<void *, unsigned int> allocated; //Chunks handed out, by base address, so a free finds its chunk directly
+    unsigned int topChunk; //Chunk at the top of the pool, where the system pool grows and shrinks
+    /* Fixed pools hand out objects of one size packed back to back. A freed object holds the link to the next
+     * free one in its first word, and objects above slabNext have never been handed out at all.*/
+    TVMMemorySize objSize;
+    uint8_t *slabFirst; //First object, base rounded up to VM_POOL_ALIGN
+    uint8_t *slabNext;
+    uint8_t *slabEnd; //Past the last whole object
+    void *slabFree;
+    vector<uint64_t> slabLive; //Bit per object, set while it is allocated
+    unsigned int slabUsed;
+    /* Arena pools hand out space by moving arenaTop up and only get it back all at once on a reset, apart from
+     * the most recent allocation which can be given back on its own.*/
+    uint8_t *arenaTop;
+    uint8_t *arenaLast; //Start of the most recent allocation, NULL if it was freed or there is none
+    /* Buddy pools split their space into power of two blocks aligned to their size relative to buddyBase. Free
+     * blocks are marked by position in a bitmap per order, so a split always takes the lowest free block and
+     * live blocks pack towards the bottom, leaving whole blocks free above them. buddyOrders has a byte per
+     * granule giving the order of the block starting there, with VM_BUDDY_FREE set while it is free.*/
+    uint8_t *buddyBase;
+    TVMMemorySize buddyLength;
+    BlockBitmap buddyFree[VM_BUDDY_ORDERS];
+    unsigned int buddyMap; //Bit n is set while buddyFree[n] is not empty
+    vector<uint8_t> buddyOrders;
+    unsigned int buddyUsed;
 } MemoryPool;
 
 typedef struct{
     TVMMutexID muxID;
     TVMThreadID ownerID;
     bool locked;
-    queue<TVMThreadID> highMuxQ;
-    queue<TVMThreadID> medMuxQ;
-    queue<TVMThreadID> lowMuxQ;
+    ThreadQueue waiters;
     bool deleted;
 } Mux;
 
+typedef struct{
+    TVMCondID condID;
+    ThreadQueue waiters;
+    bool deleted;
+} Cond;
+
+typedef struct{
+    TVMSemaphoreID semID;
+    unsigned int count;
+    ThreadQueue waiters;
+    bool deleted;
+} Semaphore;
+
 vector<Mux> MuxList;
 
-vector<MemoryPool> MemoryPoolList;
+vector<Cond> CondList;
+
+vector<Semaphore> SemaphoreList;
 
-MemoryPool SharedPool;
+/* Pools are indexed by slot like the TCBs, the API ID is the slot with the slot's generation above it. Slot 0
+ * is the shared space and slot 1 the system pool, both at generation 0 so their IDs are the slot numbers. A
+ * deque never moves a pool that is already in it.*/
+#define VM_POOL_SLOT_BITS                       16
+#define VM_POOL_SLOT_MASK                       ((1 << VM_POOL_SLOT_BITS) - 1)
+#define VM_POOL_SLOT_LIMIT                      VM_POOL_SLOT_MASK
 
-MemoryPool MainPool;
+deque<MemoryPool> MemoryPoolList;
+vector<TVMMemoryPoolID> MemoryPoolFreeList;
+
+/*The ID the API hands out for a pool slot.*/
+TVMMemoryPoolID poolHandle(TVMMemoryPoolID slot){
+    return slot | ((MemoryPoolList[slot].generation & VM_POOL_SLOT_MASK) << VM_POOL_SLOT_BITS);
+}
+
+/*The slot an API pool ID refers to, VM_MEMORY_POOL_ID_INVALID if it was never handed out or has been deleted.*/
+TVMMemoryPoolID poolSlot(TVMMemoryPoolID memory){
+    TVMMemoryPoolID slot = memory & VM_POOL_SLOT_MASK;
+    if(slot >= MemoryPoolList.size() || MemoryPoolList[slot].deleted || poolHandle(slot) != memory){
+        return VM_MEMORY_POOL_ID_INVALID;
+    }
+    return slot;
+}
+
+/*Takes a slot off the free list, or adds one to the end of the table if there are none.*/
+TVMMemoryPoolID poolSlotAlloc(){
+    if(!MemoryPoolFreeList.empty()){
+        TVMMemoryPoolID slot = MemoryPoolFreeList.back();
+        MemoryPoolFreeList.pop_back();
+        return slot;
+    }
+    if(MemoryPoolList.size() >= VM_POOL_SLOT_LIMIT){
+        return VM_MEMORY_POOL_ID_INVALID;
+    }
+    MemoryPoolList.push_back(MemoryPool());
+    return MemoryPoolList.size() - 1;
+}
 
 TVMMemorySize VMHeapSize;
 TVMMemorySize VMSharedSize;
 
-Mux sharedLock; //The owner of this lock is the next thread to have access to the shared space
+/* The system pool sits at the bottom of a reserved range of address space. It starts out with VMHeapSize
+ * bytes committed and commits further extents above them as it runs out, giving them back once they are free.*/
+#define VM_HEAP_RESERVE                         0x80000000U
+#define VM_HEAP_EXTENT                          0x1000000
+
+uint8_t *HeapBase;
+TVMMemorySize HeapReserved; //Bytes the system pool can grow to, VMHeapSize if nothing could be reserved
+
+/* Each thread with a transfer in flight holds its own slot of the shared space, so any number of transfers can be
+ * outstanding at once. Threads only wait when no slot can be carved out of what is left.*/
+#define VM_IO_SLOT_MIN                          0x1000
+#define VM_IO_PIPELINE_DEPTH                    4
+#define VM_IO_CHUNK_MIN                         0x10000
+
+unsigned int IOPipelineDepth; //Pieces a transfer keeps in flight, 1 on a single processor where nothing overlaps
+
+/* The request records of a thread and the shared slot its transfer holds. They outlive the thread's stack, so
+ * a thread terminated with requests in flight leaves them behind orphaned, and the last one to complete gives the
+ * slot back and frees the context. The thread carries on with a fresh one.*/
+typedef struct IOContext{
+    IOChunk chunks[VM_IO_PIPELINE_DEPTH];
+    unsigned int inFlight;
+    void *slot; //Slot of the shared space held by the transfer, NULL if none
+    bool orphaned;
+} IOContext;
+
+IOContext *ioContextCreate(){
+    return new IOContext();
+}
+
+ThreadQueue SharedWaiters; //Threads waiting for room in the shared space
+unsigned int SharedSlots; //Slots currently held
+set<uint8_t *> SharedBuffers; //Blocks handed out by VMSharedBufferAllocate, by base address
+
+/* Requests in flight are held to what the machine can queue. A thread with nothing in flight waits for one to
+ * complete, a pipelined transfer just keeps fewer pieces in flight.*/
+#define VM_IO_REQUEST_LIMIT                     MACHINE_MAX_REQUESTS
+
+ThreadQueue RequestWaiters; //Threads waiting for a request to complete so they can make one
+unsigned int IORequests; //Requests handed to the machine that haven't completed
+
+#define VM_STACK_GUARD_MIN                      0x10000
+#define VM_HUGE_PAGE_SIZE                       0x200000
+#define VM_STACK_WARM_SIZE                      0x4000
+#define VM_STACK_CACHE_HOT                      8
+
+typedef struct{
+    vector<void *> stacks;
+    unsigned int trimmed; //Stacks below this index have already been trimmed
+} StackCacheClass;
 
-void changeMuxOwner(TVMMutexID mutex, TVMThreadID myTurn);
+size_t VMPageSize;
+map<TVMMemorySize, StackCacheClass> StackCache; //Stacks of deleted threads by allocation size
+TVMMemorySize StackCacheBytes = 0;
 
 void pushThreadToCorrectQ(TVMThreadID idPushing);
 
+void ticklessEnterIdle();
+
+void timerWheelInsert(TimerWheel &w, TVMThreadID id, TVMTick ticks);
+
+void timerWheelCancel(TimerWheel &w, TVMThreadID id);
+
+void VMSchedule();
+
+bool ioBufferRelease(void *buffer);
+
+void poolInit(MemoryPool &pool, TVMMemoryPoolID id, void *base, TVMMemorySize size);
+
+TVMMemorySize poolLargestFree(const MemoryPool &pool);
+
+void *poolAllocate(MemoryPool &pool, TVMMemorySize size, TVMMemorySize align);
+
+bool poolDeallocate(MemoryPool &pool, void *pointer);
+
+TVMMemorySize poolBlockSize(MemoryPool &pool, void *pointer);
+
+void priorityRecompute(TVMThreadID id);
+
+void VMCriticalEnter();
+
+void VMCriticalLeave();
+
+/*Maps a thread priority onto a queue level. Anything that isn't normal or high is treated as low.*/
+unsigned int queueLevel(TVMThreadPriority prio){
+    if(prio == VM_THREAD_PRIORITY_HIGH || prio == VM_THREAD_PRIORITY_NORMAL){
+        return prio;
+    }
+    return VM_THREAD_PRIORITY_LOW;
+}
+
+void threadQueueInit(ThreadQueue &q){
+    for(unsigned int level = 0; level < VM_QUEUE_LEVELS; level++){
+        q.head[level] = VM_THREAD_ID_INVALID;
+        q.tail[level] = VM_THREAD_ID_INVALID;
+    }
+    q.bitmap = 0;
+}
+
+/*Returns the highest non-empty level of the queue, or 0 if the queue is empty.*/
+unsigned int threadQueueTopLevel(const ThreadQueue &q){
+    if(q.bitmap == 0){
+        return 0;
+    }
+    return (sizeof(unsigned int) * 8 - 1) - __builtin_clz(q.bitmap);
+}
+
+/*Appends the thread to the tail of the level matching its priority.*/
+void threadQueuePush(ThreadQueue &q, TVMThreadID id){
+    unsigned int level = queueLevel(TCBList[id].prio);
+    TCBList[id].qLevel = level;
+    TCBList[id].queuedOn = &q;
+    TCBList[id].qNext = VM_THREAD_ID_INVALID;
+    TCBList[id].qPrev = q.tail[level];
+    if(q.tail[level] == VM_THREAD_ID_INVALID){
+        q.head[level] = id;
+    }
+    else{
+        TCBList[q.tail[level]].qNext = id;
+    }
+    q.tail[level] = id;
+    q.bitmap |= 1U << level;
+}
+
+/*Unlinks the thread from the queue. Does nothing if the thread isn't queued.*/
+void threadQueueRemove(ThreadQueue &q, TVMThreadID id){
+    unsigned int level = TCBList[id].qLevel;
+    if(level == 0){
+        return;
+    }
+    if(TCBList[id].qPrev == VM_THREAD_ID_INVALID){
+        q.head[level] = TCBList[id].qNext;
+    }
+    else{
+        TCBList[TCBList[id].qPrev].qNext = TCBList[id].qNext;
+    }
+    if(TCBList[id].qNext == VM_THREAD_ID_INVALID){
+        q.tail[level] = TCBList[id].qPrev;
+    }
+    else{
+        TCBList[TCBList[id].qNext].qPrev = TCBList[id].qPrev;
+    }
+    if(q.head[level] == VM_THREAD_ID_INVALID){
+        q.bitmap &= ~(1U << level);
+    }
+    TCBList[id].qLevel = 0;
+    TCBList[id].queuedOn = NULL;
+    TCBList[id].qNext = VM_THREAD_ID_INVALID;
+    TCBList[id].qPrev = VM_THREAD_ID_INVALID;
+}
+
+/*Removes and returns the thread at the head of the highest non-empty level, VM_THREAD_ID_INVALID if empty.*/
+TVMThreadID threadQueuePop(ThreadQueue &q){
+    unsigned int level = threadQueueTopLevel(q);
+    if(level == 0){
+        return VM_THREAD_ID_INVALID;
+    }
+    TVMThreadID id = q.head[level];
+    threadQueueRemove(q, id);
+    return id;
+}
+
+/* Blocks the current thread on a wait queue until it is woken or the timeout runs out, the timeout is in ticks
+ * or VM_TIMEOUT_INFINITE. Returns false if the wait timed out.*/
+bool threadWait(ThreadQueue &q, TVMTick timeout){
+    TVMThreadID id = CurThreadID;
+    TCBList[id].state = VM_THREAD_STATE_WAITING;
+    TCBList[id].waitQueue = &q;
+    TCBList[id].waitTimedOut = false;
+    threadQueuePush(q, id);
+    if(timeout != VM_TIMEOUT_INFINITE){
+        timerWheelInsert(SleepWheel, id, timeout);
+    }
+    VMSchedule();
+    return !TCBList[id].waitTimedOut;
+}
+
+/* Makes the highest priority thread waiting on the queue ready. Returns the woken thread, or
+ * VM_THREAD_ID_INVALID if nothing was waiting.*/
+TVMThreadID threadWakeOne(ThreadQueue &q){
+    TVMThreadID id = threadQueuePop(q);
+    if(id != VM_THREAD_ID_INVALID){
+        timerWheelCancel(SleepWheel, id);
+        TCBList[id].waitQueue = NULL;
+        TCBList[id].state = VM_THREAD_STATE_READY;
+        pushThreadToCorrectQ(id);
+    }
+    return id;
+}
+
 /* The idle thread. This thread is to run only when there are no other threads or all other threads are waiting.*/
+/* Rather than spinning it sleeps until a signal arrives, either the alarm or an IO completion. */
 void VMIdleThread( void * param){
     MachineEnableSignals();
+    thisWorker()->signalMaskDirty = false;
+    thisWorker()->criticalDepth = 1;
+    VMCriticalLeave();
     ////cout << "\nIdle Thread Is Running!!!\n";
-    while(true);
+    while(true){
+        /* Leaving the critical section replays anything deferred, so nothing is left waiting on a signal that
+         * already arrived. A signal landing between the leave and the wait is handled right away.*/
+        VMCriticalEnter();
+        if(VMOptionTickless){
+            ticklessEnterIdle();
+        }
+        VMCriticalLeave();
+        MachineWaitSignals();
+    }
 }
 
 /*Once the new thread to be run is determined a context switch happens here so the new thread will become
  * the current thread.*/
 void Dispatcher(TVMThreadID newThreadId){
     //cout << "\nDispatcher has been entered\n";
-    TVMThreadID oldThread = CurThreadID;
-    CurThreadID = newThreadId;
-    TCBList[CurThreadID].state = VM_THREAD_STATE_RUNNING;
+    Worker *worker = thisWorker();
+    TVMThreadID oldThread = worker->curThread;
+    worker->curThread = newThreadId;
+    TCBList[newThreadId].state = VM_THREAD_STATE_RUNNING;
 
     //cout << "\nDISPATCHER: RIGHT NOW thread " << oldThread << " with priority "<< TCBList[oldThread].prio << " is going to be switched to thread " << CurThreadID << "with priority " << TCBList[CurThreadID].prio << "\n";
     //cout << "\nDISPATCHER: The queue contains: " << HighPriorityQ.size() << " " << MedPriorityQ.size() << " " << LowPriorityQ.size() << "\n";
-    MachineContextSwitch(&(TCBList[oldThread].cont), &(TCBList[CurThreadID].cont));
+    TCBList[oldThread].critDepth = worker->criticalDepth;
+    if(TCBList[oldThread].signalDepth != 0){
+        worker->signalMaskDirty = true;
+    }
+    MachineContextSwitch(&(TCBList[oldThread].cont), &(TCBList[newThreadId].cont));
+    /* Back on this thread, possibly on another worker. If the thread before it was switched out inside a handler
+     * the signals are still blocked, a thread that isn't inside a handler itself has to unblock them.*/
+    worker = thisWorker();
+    worker->criticalDepth = TCBList[worker->curThread].critDepth;
+    if(worker->signalMaskDirty){
+        worker->signalMaskDirty = false;
+        if(TCBList[worker->curThread].signalDepth == 0){
+            MachineEnableSignals();
+        }
+    }
 }
 
+void timerWheelInit(TimerWheel &w, TVMTick now){
+    for(unsigned int slot = 0; slot < TIMER_SLOTS; slot++){
+        w.head[slot] = VM_THREAD_ID_INVALID;
+    }
+    w.now = now;
+    w.count = 0;
+}
 
-/* When a it is time for a new thread to be scheduled the current thread is compared to theads in the different queues.
- * If the current thread is running and a thread with a higher or equal priority is found then the current thread will
- * be put at the  end of the appropriate queue and the new thread will be scheduled. If the current thread isn't running
- * and no other thread is in any queue then the idle thread will run.*/
-void VMSchedule(){
-    TVMThreadID currId = CurThreadID;
-    /*Checks if thread is currently running.*/
-    if(TCBList[currId].state == VM_THREAD_STATE_RUNNING){
-
-        /*High Priority*/
-        if(!HighPriorityQ.empty()){
-            TVMThreadID next_thread = HighPriorityQ.front();
-            HighPriorityQ.pop();
-            TCBList[currId].state = VM_THREAD_STATE_READY;
-            if(currId != 0) {
-              pushThreadToCorrectQ(currId); //this was push to highQ
-            }
-            Dispatcher(next_thread);
+/*Picks the slot for an expiry tick based on how far in the future it is.*/
+int timerWheelSlot(const TimerWheel &w, TVMTick expiry){
+    TVMTick delta = expiry - w.now;
+    if(delta < TIMER_ROOT_SIZE){
+        return expiry & (TIMER_ROOT_SIZE - 1);
+    }
+    for(unsigned int level = 1; level < TIMER_LEVELS; level++){
+        if(delta < (1U << (TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS))){
+            return TIMER_ROOT_SIZE + (level - 1) * TIMER_LEVEL_SIZE + ((expiry >> (TIMER_ROOT_BITS + (level - 1) * TIMER_LEVEL_BITS)) & (TIMER_LEVEL_SIZE - 1));
         }
+    }
+    return TIMER_ROOT_SIZE + (TIMER_LEVELS - 1) * TIMER_LEVEL_SIZE + ((expiry >> (TIMER_ROOT_BITS + (TIMER_LEVELS - 1) * TIMER_LEVEL_BITS)) & (TIMER_LEVEL_SIZE - 1));
+}
 
-        /*Medium Priority*/
-        else if(TCBList[currId].prio < VM_THREAD_PRIORITY_HIGH && !MedPriorityQ.empty()){
-            TVMThreadID next_thread = MedPriorityQ.front();
-            MedPriorityQ.pop();
-            TCBList[currId].state = VM_THREAD_STATE_READY;
-            if(currId != 0){
-              pushThreadToCorrectQ(currId); //this was push to medQ
-            }
-            Dispatcher(next_thread);
+void timerWheelLink(TimerWheel &w, TVMThreadID id){
+    int slot = timerWheelSlot(w, TCBList[id].wakeTick);
+    TCBList[id].tSlot = slot;
+    TCBList[id].tPrev = VM_THREAD_ID_INVALID;
+    TCBList[id].tNext = w.head[slot];
+    if(w.head[slot] != VM_THREAD_ID_INVALID){
+        TCBList[w.head[slot]].tPrev = id;
+    }
+    w.head[slot] = id;
+}
+
+/*Arms a timer for the thread that expires after the given number of ticks.*/
+void timerWheelInsert(TimerWheel &w, TVMThreadID id, TVMTick ticks){
+    if(ticks > TIMER_MAX_DELTA){
+        ticks = TIMER_MAX_DELTA;
+    }
+    TCBList[id].wakeTick = w.now + ticks;
+    timerWheelLink(w, id);
+    w.count++;
+}
+
+/*Disarms the thread's timer. Does nothing if the thread has no timer pending.*/
+void timerWheelCancel(TimerWheel &w, TVMThreadID id){
+    int slot = TCBList[id].tSlot;
+    if(slot < 0){
+        return;
+    }
+    if(TCBList[id].tPrev == VM_THREAD_ID_INVALID){
+        w.head[slot] = TCBList[id].tNext;
+    }
+    else{
+        TCBList[TCBList[id].tPrev].tNext = TCBList[id].tNext;
+    }
+    if(TCBList[id].tNext != VM_THREAD_ID_INVALID){
+        TCBList[TCBList[id].tNext].tPrev = TCBList[id].tPrev;
+    }
+    TCBList[id].tSlot = -1;
+    TCBList[id].tNext = VM_THREAD_ID_INVALID;
+    TCBList[id].tPrev = VM_THREAD_ID_INVALID;
+    w.count--;
+}
+
+/*Moves every timer in an outer slot down to wherever it belongs relative to the current tick.*/
+void timerWheelCascade(TimerWheel &w, int slot){
+    TVMThreadID id = w.head[slot];
+    w.head[slot] = VM_THREAD_ID_INVALID;
+    while(id != VM_THREAD_ID_INVALID){
+        TVMThreadID next = TCBList[id].tNext;
+        timerWheelLink(w, id);
+        id = next;
+    }
+}
+
+/*Advances the wheel by one tick and wakes every thread whose timer expires on it.*/
+void timerWheelAdvance(TimerWheel &w){
+    w.now++;
+    unsigned int index = w.now & (TIMER_ROOT_SIZE - 1);
+    for(unsigned int level = 1; index == 0 && level <= TIMER_LEVELS; level++){
+        index = (w.now >> (TIMER_ROOT_BITS + (level - 1) * TIMER_LEVEL_BITS)) & (TIMER_LEVEL_SIZE - 1);
+        timerWheelCascade(w, TIMER_ROOT_SIZE + (level - 1) * TIMER_LEVEL_SIZE + index);
+    }
+    int slot = w.now & (TIMER_ROOT_SIZE - 1);
+    while(w.head[slot] != VM_THREAD_ID_INVALID){
+        TVMThreadID id = w.head[slot];
+        timerWheelCancel(w, id);
+        if(TCBList[id].waitQueue != NULL){
+            threadQueueRemove(*TCBList[id].waitQueue, id);
+            TCBList[id].waitQueue = NULL;
+            TCBList[id].waitTimedOut = true;
         }
+        TCBList[id].state = VM_THREAD_STATE_READY;
+        pushThreadToCorrectQ(id);
+    }
+}
 
-        /*Low Priority*/
-        else if(TCBList[currId].prio < VM_THREAD_PRIORITY_NORMAL && !LowPriorityQ.empty()){
-            TVMThreadID next_thread = LowPriorityQ.front();
-            LowPriorityQ.pop();
-            TCBList[currId].state = VM_THREAD_STATE_READY;
-            if(currId != 0) {
-              pushThreadToCorrectQ(currId); //this was push to lowQ
-            }
-            Dispatcher(next_thread);
+/*Returns how many ticks until the wheel next has work to do, or 0 if no timers are pending. Only the root
+ * wheel is searched, so if nothing expires before the root wraps the next cascade point is returned instead.*/
+TVMTick timerWheelNextEvent(const TimerWheel &w){
+    if(w.count == 0){
+        return 0;
+    }
+    TVMTick ahead = 1;
+    for(; ahead < TIMER_ROOT_SIZE; ahead++){
+        unsigned int index = (w.now + ahead) & (TIMER_ROOT_SIZE - 1);
+        if(w.head[index] != VM_THREAD_ID_INVALID || index == 0){
+            break;
         }
     }
+    return ahead;
+}
 
-    /*If thread is not running and thread is found then idle thread will run next.*/
+uint64_t monotonicMicroseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*Called by the idle thread with signals suspended. Replaces the periodic alarm with a single alarm at the
+ * next timer expiry, or no alarm at all if nothing is sleeping, so an idle VM only wakes when it has to.*/
+void ticklessEnterIdle(){
+    uint64_t tickUS = (uint64_t)tickDur * 1000;
+    TVMTick ahead = timerWheelNextEvent(SleepWheel);
+    ticklessIdle = true;
+    if(ahead == 0){
+        MachineRescheduleAlarm(0, 0);
+    }
     else{
+        uint64_t now = monotonicMicroseconds();
+        uint64_t deadline = ticklessPhaseUS + ahead * tickUS;
+        MachineRescheduleAlarm(deadline > now ? deadline - now : 1, 0);
+    }
+}
 
-        /*High Priority*/
-        if(!HighPriorityQ.empty()){
-            TVMThreadID next_thread = HighPriorityQ.front();
-            HighPriorityQ.pop();
-            Dispatcher(next_thread);
-        }
+/*Catches the tick count and the timer wheel up with the time spent idle and restarts the periodic alarm.*/
+void ticklessLeaveIdle(){
+    uint64_t tickUS = (uint64_t)tickDur * 1000;
+    uint64_t now = monotonicMicroseconds();
+    uint64_t elapsed = (now - ticklessPhaseUS) / tickUS;
+    for(uint64_t i = 0; i < elapsed; i++){
+        tickCount++;
+        timerWheelAdvance(SleepWheel);
+    }
+    ticklessPhaseUS += elapsed * tickUS;
+    ticklessIdle = false;
+    MachineRescheduleAlarm(ticklessPhaseUS + tickUS - now, tickUS);
+}
+
+/*Idle threads are never queued, each worker falls back to its own when it has nothing else to run.*/
+bool isIdleThread(TVMThreadID id){
+    return TCBList[id].entry == VMIdleThread;
+}
 
-        /*Medium Priority*/
-        else if(!MedPriorityQ.empty()){
-            TVMThreadID next_thread = MedPriorityQ.front();
-            MedPriorityQ.pop();
+/* When a it is time for a new thread to be scheduled the current thread is compared to the highest priority ready thread.
+ * If the current thread is running and a thread with a higher or equal priority is ready then the current thread will
+ * be put at the end of its level of the ready queue and the new thread will be scheduled. If the current thread isn't running
+ * and no other thread is ready then the idle thread will run. With several workers the highest priority ready thread is
+ * taken from whichever worker has it, preferring this worker's own queue on a tie, so a worker with nothing better to do
+ * steals work from the others.*/
+void VMSchedule(){
+    Worker *worker = thisWorker();
+    TVMThreadID currId = worker->curThread;
+    /*A dead thread is about to be switched out for good, anything waiting for that can go once the switch is done.*/
+    if(TCBList[currId].state == VM_THREAD_STATE_DEAD){
+        while(threadWakeOne(SwitchOutWaiters) != VM_THREAD_ID_INVALID){
+        }
+    }
+    Worker *source = worker;
+    unsigned int readyLevel = threadQueueTopLevel(worker->readyQueue);
+    for(unsigned int i = 0; i < Workers.size(); i++){
+        unsigned int level = threadQueueTopLevel(Workers[i]->readyQueue);
+        if(level > readyLevel){
+            readyLevel = level;
+            source = Workers[i];
+        }
+    }
+    /*Checks if thread is currently running.*/
+    if(TCBList[currId].state == VM_THREAD_STATE_RUNNING){
+        if(readyLevel != 0 && readyLevel >= TCBList[currId].prio){
+            TVMThreadID next_thread = threadQueuePop(source->readyQueue);
+            TCBList[currId].state = VM_THREAD_STATE_READY;
+            pushThreadToCorrectQ(currId);
             Dispatcher(next_thread);
         }
+    }
 
-        /*Low Priority*/
-        else if(!LowPriorityQ.empty()){
-            TVMThreadID next_thread = LowPriorityQ.front();
-            LowPriorityQ.pop();
-            Dispatcher(next_thread);
+    /*If thread is not running and thread is found then idle thread will run next.*/
+    else{
+        if(readyLevel != 0){
+            Dispatcher(threadQueuePop(source->readyQueue));
         }
 
         /*Idel thread*/
         else{
-            Dispatcher(0);
+            Dispatcher(worker->idleThread);
         }
     }
 
 }
 
 
-/*Pushes the thread to the correct Queue based on its priority.*/
+/* Pushes the thread onto this worker's ready queue at the level for its priority. If another worker is running
+ * something of lower priority, or is idle, it is kicked so it can come and take the thread.*/
 void pushThreadToCorrectQ(TVMThreadID idPushing){
-    if(TCBList[idPushing].prio == VM_THREAD_PRIORITY_HIGH){
-        HighPriorityQ.push(idPushing);
+    if(isIdleThread(idPushing)){
+        return;
+    }
+    Worker *worker = thisWorker();
+    threadQueuePush(worker->readyQueue, idPushing);
+    Worker *target = NULL;
+    for(unsigned int i = 0; i < Workers.size(); i++){
+        TVMThreadPriority running = TCBList[Workers[i]->curThread].prio;
+        if(Workers[i] != worker && running < TCBList[idPushing].prio && (target == NULL || running < TCBList[target->curThread].prio)){
+            target = Workers[i];
+        }
     }
-    else if(TCBList[idPushing].prio == VM_THREAD_PRIORITY_NORMAL){
-        MedPriorityQ.push(idPushing);
+    if(target != NULL){
+        MachineKickProcessor(target->index);
     }
-    else if(idPushing != 0){
-        LowPriorityQ.push(idPushing);
+}
+
+
+/* Once the alarm has gone off, once each tick, the timer wheel is advanced to wake up any
+ * sleeping threads that expire on this tick. */
+void alarmTick(){
+    if(ticklessIdle){
+        ticklessLeaveIdle();
     }
+    else{
+        tickCount++;
+        if(VMOptionTickless){
+            ticklessPhaseUS = monotonicMicroseconds();
+        }
 
+        /*Waking the threads whose timers expire on this tick.*/
+        timerWheelAdvance(SleepWheel);
+    }
 }
 
+/* A request has finished, its thread is only woken if it is waiting for this one. The result was already stored
+ * by the handler.*/
+void ioChunkComplete(IOChunk *chunk){
+    if(ticklessIdle){
+        ticklessLeaveIdle();
+    }
+    IORequests--;
+    threadWakeOne(RequestWaiters);
+    IOContext *context = chunk->context;
+    context->inFlight--;
+    if(context->orphaned){
+        if(context->inFlight == 0){
+            if(context->slot != NULL){
+                ioBufferRelease(context->slot);
+            }
+            delete context;
+        }
+        return;
+    }
+    chunk->done = true;
+    if(chunk->waiting){
+        chunk->waiting = false;
+        TCBList[chunk->thread].state = VM_THREAD_STATE_READY;
+        pushThreadToCorrectQ(chunk->thread);
+    }
+}
 
-/* Once the alarm has gone off, once each tick, there will be a check to see if any of
- * the sleeping threads to need to be woken up. Then the scheduler will be called. */
-void AlarmCallback(void * param){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    tickCount++;
+bool pendingWork(Worker *worker){
+    return worker->ticksRaised != worker->ticksHandled || worker->kicksRaised != worker->kicksHandled || worker->ioDone != NULL;
+}
 
-    /*Checking for to see if any threads want to be worken up.*/
-    for(unsigned int i = 0; i < SleepyThreads.size(); i++){
-        TCBList[SleepyThreads[i]].sleepTicks--;
-        if(TCBList[SleepyThreads[i]].sleepTicks == 0){
-            TCBList[SleepyThreads[i]].state = VM_THREAD_STATE_READY;
-            pushThreadToCorrectQ(SleepyThreads[i]);
-            SleepyThreads.erase(SleepyThreads.begin() + i);
-            i--; //Decrement i since we lose a member
+/* Replays the ticks, kicks and IO completions the handlers deferred, then calls the scheduler. Must be called
+ * from the outermost critical section. Only one worker counts each alarm, so it passes the tick on to the
+ * others as a kick to give them a chance to preempt too.*/
+void runPendingWork(){
+    Worker *worker = thisWorker();
+    bool ticked = false;
+    while(worker->ticksHandled != worker->ticksRaised){
+        alarmTick();
+        worker->ticksHandled = worker->ticksHandled + 1;
+        ticked = true;
+    }
+    worker->kicksHandled = worker->kicksRaised;
+    if(worker->ioDone != NULL){
+        /*The list is newest first, so it is turned around to replay the completions in the order they came.*/
+        IOChunk *done = __sync_lock_test_and_set(&worker->ioDone, (IOChunk *)NULL);
+        IOChunk *ordered = NULL;
+        while(done != NULL){
+            IOChunk *next = done->next;
+            done->next = ordered;
+            ordered = done;
+            done = next;
+        }
+        while(ordered != NULL){
+            IOChunk *next = ordered->next;
+            ioChunkComplete(ordered);
+            ordered = next;
+        }
+    }
+    if(ticked){
+        for(unsigned int i = 0; i < Workers.size(); i++){
+            if(Workers[i] != worker){
+                MachineKickProcessor(Workers[i]->index);
+            }
         }
     }
     VMSchedule();
-    MachineResumeSignals(&sigState);
 }
 
+/*The VM lock is only needed once there is more than one worker.*/
+void vmLockAcquire(){
+    if(Workers.size() > 1){
+        while(__sync_lock_test_and_set(&VMLock, 1)){
+            while(VMLock){
+                sched_yield();
+            }
+        }
+    }
+}
+
+void vmLockRelease(){
+    if(Workers.size() > 1){
+        __sync_lock_release(&VMLock);
+    }
+}
 
+void VMCriticalEnter(){
+    Worker *worker = thisWorker();
+    if(worker->criticalDepth == 0){
+        worker->criticalDepth = 1;
+        __asm__ __volatile__("" ::: "memory");
+        vmLockAcquire();
+        /* Another worker may have terminated this thread while it waited for the lock, it is switched out before
+         * it can touch anything. It may be inside a handler or not, so the next thread sorts out the signals.*/
+        if(Workers.size() > 1 && TCBList[worker->curThread].state == VM_THREAD_STATE_DEAD){
+            worker->signalMaskDirty = true;
+            VMSchedule();
+        }
+    }
+    else{
+        worker->criticalDepth = worker->criticalDepth + 1;
+    }
+    __asm__ __volatile__("" ::: "memory");
+}
 
-/* After IO call has finished the data is recieved and the waiting thread is put to ready
- * and the scheduler is called to schedule a new thread.*/
-void IOCallback (void *calldata, int result){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    int IOThreadID = *((int *)calldata);
-    TCBList[IOThreadID].state = VM_THREAD_STATE_READY;
-    pushThreadToCorrectQ(IOThreadID);
-    TCBList[IOThreadID].retVal = result;
-    VMSchedule();
-    MachineResumeSignals(&sigState);
+/* Leaves a critical section. The outermost leave replays any deferred work first, and checks again after the
+ * depth drops to zero in case a handler deferred something in between.*/
+void VMCriticalLeave(){
+    while(true){
+        Worker *worker = thisWorker();
+        if(worker->criticalDepth == 1 && pendingWork(worker)){
+            runPendingWork();
+            continue;
+        }
+        __asm__ __volatile__("" ::: "memory");
+        if(worker->criticalDepth != 1){
+            worker->criticalDepth = worker->criticalDepth - 1;
+            break;
+        }
+        vmLockRelease();
+        __asm__ __volatile__("" ::: "memory");
+        worker->criticalDepth = 0;
+        __asm__ __volatile__("" ::: "memory");
+        if(!pendingWork(worker)){
+            break;
+        }
+        worker->criticalDepth = 1;
+        __asm__ __volatile__("" ::: "memory");
+        vmLockAcquire();
+    }
+}
+
+/* Parks a worker for good with its signals blocked, whatever thread it was running is never resumed.*/
+void workerPark(){
+    TMachineSignalState sigstate;
+    MachineSuspendSignals(&sigstate);
+    thisWorker()->stopped = true;
+    while(true){
+        pause();
+    }
+}
+
+/* Runs the handler work now unless the interrupted code is inside a critical section, in which case it is
+ * left for the critical section to replay on its way out.*/
+void signalArrived(){
+    if(thisWorker()->criticalDepth != 0){
+        return;
+    }
+    if(VMStoppingWorker != NULL && VMStoppingWorker != thisWorker()){
+        workerPark();
+    }
+    VMCriticalEnter();
+    TVMThreadID handlerThread = CurThreadID;
+    TCBList[handlerThread].signalDepth++;
+    runPendingWork();
+    TCBList[handlerThread].signalDepth--;
+    VMCriticalLeave();
+}
+
+void AlarmCallback(void * param){
+    Worker *worker = thisWorker();
+    worker->ticksRaised = worker->ticksRaised + 1;
+    signalArrived();
+}
+
+void KickCallback(void * param){
+    Worker *worker = thisWorker();
+    worker->kicksRaised = worker->kicksRaised + 1;
+    signalArrived();
 }
 
+/*Called for each completion in a batch, they are all handled together once ReplyDoneCallback runs.*/
+void IOChunkCallback (void *calldata, int result){
+    Worker *worker = thisWorker();
+    IOChunk *chunk = (IOChunk *)calldata;
+    chunk->result = result;
+    chunk->next = worker->ioDone;
+    __asm__ __volatile__("" ::: "memory");
+    worker->ioDone = chunk;
+}
+
+void ReplyDoneCallback(void * param){
+    signalArrived();
+}
+
+/*Blocks until the machine has room for another request.*/
+void ioRequestWait(){
+    while(IORequests >= VM_IO_REQUEST_LIMIT){
+        threadWait(RequestWaiters, VM_TIMEOUT_INFINITE);
+    }
+}
+
+/* Sets up a request record for the current thread before it is handed to the machine, and counts the request.
+ * There has to be room for it.*/
+void ioChunkInit(IOChunk &chunk){
+    IORequests++;
+    chunk.thread = CurThreadID;
+    chunk.context = TCBList[chunk.thread].io;
+    chunk.context->inFlight++;
+    chunk.done = false;
+    chunk.waiting = false;
+}
+
+/*Blocks until the request has come back and returns its result.*/
+int ioChunkWait(IOChunk &chunk){
+    if(!chunk.done){
+        chunk.waiting = true;
+        TCBList[chunk.thread].state = VM_THREAD_STATE_WAITING;
+        VMSchedule();
+    }
+    return chunk.result;
+}
+
+
 
 /* When a new thread starts, it goes here first so that there is a container around the
  * function the thread will be running. This allows us to terminate the thread once it does executing
  * its function.*/
 void skeleton(void *param){
     MachineEnableSignals();
+    thisWorker()->signalMaskDirty = false;
+    thisWorker()->criticalDepth = 1;
+    VMCriticalLeave();
     int threadID = *((int *)param);
     TCBList[threadID].entry(TCBList[threadID].param);
-    VMThreadTerminate(threadID);
+    VMThreadTerminate(threadHandle(threadID));
+}
+
+
+/*Adds a worker to the list along with the idle thread it falls back to.*/
+void workerInit(Worker *worker, int index, TVMMemorySize idleStackSize){
+    TVMThreadID idleThread;
+    worker->index = index;
+    threadQueueInit(worker->readyQueue);
+    Workers.push_back(worker);
+    VMThreadCreate(VMIdleThread, NULL, idleStackSize, 0, &idleThread);
+    VMThreadActivate(idleThread);
+    worker->idleThread = threadSlot(idleThread);
+}
+
+/* Entry point of the extra OS threads started for -w. The worker starts in its idle thread, which takes it into
+ * the scheduler like any other thread leaving a critical section.*/
+void workerMain(int index, void *param){
+    LocalWorker = Workers[index];
+    VMCriticalEnter();
+    Worker *worker = thisWorker();
+    worker->curThread = worker->idleThread;
+    TCBList[worker->idleThread].state = VM_THREAD_STATE_RUNNING;
+    MachineContextSwitch(&worker->bootCont, &(TCBList[worker->idleThread].cont));
+}
+
+/* Once VMMain returns the other workers may still be running threads out of the module that is about to be
+ * unloaded. They are kicked until each one parks, a worker inside a critical section only parks once it is out.*/
+void workersStop(){
+    Worker *worker = thisWorker();
+    VMStoppingWorker = worker;
+    for(unsigned int i = 0; i < Workers.size(); i++){
+        while(Workers[i] != worker && !Workers[i]->stopped){
+            MachineKickProcessor(Workers[i]->index);
+            sched_yield();
+        }
+    }
 }
 
+/* Reserves the address space for the system pool without backing it, and commits the first heapsize bytes.
+ * With huge pages the range starts on a huge page boundary and is asked to be backed by them, so the stacks and
+ * buffers carved out of it take a TLB entry per 2 MB instead of per page. NULL if nothing could be reserved.*/
+void *heapReserve(TVMMemorySize heapsize){
+    TVMMemorySize reserve = heapsize > VM_HEAP_RESERVE ? heapsize : VM_HEAP_RESERVE;
+    size_t align = VMOptionHugePages ? VM_HUGE_PAGE_SIZE : VMPageSize;
+    size_t length = (size_t)reserve + align;
+    uint8_t *mapped = (uint8_t *)mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mapped == MAP_FAILED){
+        return NULL;
+    }
+    uint8_t *base = (uint8_t *)(((uintptr_t)mapped + align - 1) & ~(uintptr_t)(align - 1));
+    uint8_t *end = (uint8_t *)(((uintptr_t)base + reserve + VMPageSize - 1) & ~(uintptr_t)(VMPageSize - 1));
+    /*The slack either side of the aligned range is unmapped again.*/
+    if(base > mapped){
+        munmap(mapped, base - mapped);
+    }
+    if(end < mapped + length){
+        munmap(end, mapped + length - end);
+    }
+    if(mprotect(base, heapsize, PROT_READ | PROT_WRITE) != 0){
+        munmap(base, end - base);
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if(VMOptionHugePages){
+        madvise(base, reserve, MADV_HUGEPAGE);
+    }
+#endif
+    HeapReserved = reserve;
+    return base;
+}
 
 /*The virtual machine first starts up here.*/
 TVMStatus VMStart(int tickms, TVMMemorySize heapsize, TVMMemorySize sharedsize, int argc, char *argv[]){
@@ -256,39 +1132,75 @@ TVMStatus VMStart(int tickms, TVMMemorySize heapsize, TVMMemorySize sharedsize,
     if(VMMain == NULL){
         return VM_STATUS_FAILURE;
     }
+    if(VMOptionWorkers < 1){
+        VMOptionWorkers = 1;
+    }
+    /* Equal priority threads on different workers run side by side instead of taking turns each tick, a module
+     * that counts on them taking turns says so and isn't run with more than one.*/
+    if(VMOptionWorkers > 1 && VMModuleSingleWorker()){
+        fprintf(stderr,"Module %s expects one thread to run at a time and can't be run with -w.\n", argv[0]);
+        VMUnloadModule();
+        return VM_STATUS_FAILURE;
+    }
+    if(VMOptionWorkers > 1){
+        /*Stopping the alarm would stop it for every worker, so idle stays ticking.*/
+        VMOptionTickless = 0;
+    }
+
+    /*Worker 0 is this OS thread, its idle thread is thread 0 and is created once the system pool exists.*/
+    Worker *mainWorker = new Worker();
+    LocalWorker = mainWorker;
 
     /*Initialzing heap and shared memory*/
+    VMPageSize = sysconf(_SC_PAGESIZE);
+    IOPipelineDepth = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? VM_IO_PIPELINE_DEPTH : 1;
     VMHeapSize = heapsize;
     VMSharedSize = sharedsize;
-    vector<MemoryChunk> sharedList;
-    SharedPool = {0, MachineInitialize(sharedsize), sharedsize, sharedList}; // Pool id 0 is the shared space (NOT on global list of pools)
-    MemoryPoolList.push_back(SharedPool);
-    void * mainBase = malloc(heapsize);
-    TVMMemoryPoolID mainID = VM_MEMORY_POOL_ID_SYSTEM;
-    VMMemoryPoolCreate(mainBase, heapsize, &mainID);
+    poolInit(MemoryPoolList[poolSlotAlloc()], 0, MachineInitialize(sharedsize), sharedsize); // Pool id 0 is the shared space
+#ifndef MADV_HUGEPAGE
+    VMOptionHugePages = 0;
+#endif
+    void * mainBase = heapReserve(heapsize);
+    if(mainBase == NULL){
+        /*A heap that can't grow, as before.*/
+        VMOptionHugePages = 0;
+        mainBase = malloc(heapsize);
+        HeapReserved = heapsize;
+    }
+    HeapBase = (uint8_t *)mainBase;
+    poolInit(MemoryPoolList[poolSlotAlloc()], VM_MEMORY_POOL_ID_SYSTEM, mainBase, heapsize);
 
     /*Creatings mutex queues*/
-    queue<TVMThreadID> highMuxQ;
-    queue<TVMThreadID> medMuxQ;
-    queue<TVMThreadID> lowMuxQ;
-    sharedLock = {0, 0, false, highMuxQ, medMuxQ, lowMuxQ, false};
+    threadQueueInit(SharedWaiters);
+    threadQueueInit(RequestWaiters);
+    threadQueueInit(SwitchOutWaiters);
+    timerWheelInit(SleepWheel, tickCount);
 
     /*Initializings and activates idle thread the TCB for the main thread.*/
-    TVMThreadID VMIdleThreadId = 0;
     TVMThreadID VMMainThreadId = 1;
-    VMThreadCreate(VMIdleThread, NULL, 6400000, 0, &VMIdleThreadId);
-    VMThreadActivate(VMIdleThreadId);
-    TCB TCBMain = {VMMainThreadId, NULL, NULL, NULL, 0, 0, VM_THREAD_STATE_RUNNING, VM_THREAD_PRIORITY_NORMAL, 0, 0};
+    workerInit(mainWorker, 0, 6400000);
+    TCB TCBMain = {VMMainThreadId, NULL, NULL, NULL, 0, {}, VM_THREAD_STATE_RUNNING, VM_THREAD_PRIORITY_NORMAL, 0, 0, VM_THREAD_ID_INVALID, VM_THREAD_ID_INVALID, 0, 0, VM_THREAD_ID_INVALID, VM_THREAD_ID_INVALID, -1, 0, 0, NULL, false, VM_THREAD_PRIORITY_NORMAL, VM_MUTEX_ID_INVALID, NULL, 0, NULL, 0, {}, 0, ioContextCreate()};
     TCBMain.prio = VM_THREAD_PRIORITY_NORMAL;
+    threadQueueInit(TCBMain.joiners);
     TCBList.push_back(TCBMain);
-    CurThreadID = 1;
+    mainWorker->curThread = VMMainThreadId;
+    for(int i = 1; i < VMOptionWorkers; i++){
+        workerInit(new Worker(), i, VM_WORKER_IDLE_STACK_SIZE);
+    }
 
     /*Sets up the alarm*/
     MachineRequestAlarm(tickms*1000, AlarmCallback, NULL);
+    ticklessPhaseUS = monotonicMicroseconds();
+    MachineRequestKick(KickCallback, NULL);
+    MachineRequestReplyDone(ReplyDoneCallback, NULL);
+    MachineStartProcessors(VMOptionWorkers, workerMain, NULL);
     MachineEnableSignals();
 
 
     VMMain(argc, argv);
+    if(Workers.size() > 1){
+        workersStop();
+    }
     VMUnloadModule();
     VMMemoryPoolDelete(VM_MEMORY_POOL_ID_SYSTEM);
     MachineTerminate();
@@ -299,24 +1211,23 @@ TVMStatus VMStart(int tickms, TVMMemorySize heapsize, TVMMemorySize sharedsize,
 /*Opens a file and causes the current thread to wait for a callback till when the file is opened.
  * A new thread is scheduled.*/
 TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescriptor){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(filename == NULL || filedescriptor == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
-        int IOThreadID = CurThreadID;
-        TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-        MachineFileOpen(filename, flags, mode, IOCallback, &IOThreadID);
-        VMSchedule();
-        *filedescriptor = TCBList[IOThreadID].retVal;
+        IOChunk &request = TCBList[CurThreadID].io->chunks[0];
+        ioRequestWait();
+        ioChunkInit(request);
+        MachineFileOpen(filename, flags, mode, IOChunkCallback, &request);
+        *filedescriptor = ioChunkWait(request);
         if(*filedescriptor < 0){
-            MachineResumeSignals(&sigState);
+            VMCriticalLeave();
             return VM_STATUS_FAILURE;
         }
         else{
-            MachineResumeSignals(&sigState);
+            VMCriticalLeave();
             return VM_STATUS_SUCCESS;
         }
     }
@@ -326,352 +1237,532 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 /*Seeks with a already opened file and causes the current thread to wait for a callback till when the seeking is over.
  * A new thread is scheduled.*/
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    int IOThreadID = CurThreadID;
-    TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-    MachineFileSeek(filedescriptor, offset, whence, IOCallback, &IOThreadID);
-    VMSchedule();
-    *newoffset = TCBList[IOThreadID].retVal;
+    VMCriticalEnter();
+    IOChunk &request = TCBList[CurThreadID].io->chunks[0];
+    ioRequestWait();
+    ioChunkInit(request);
+    MachineFileSeek(filedescriptor, offset, whence, IOChunkCallback, &request);
+    *newoffset = ioChunkWait(request);
     if(*newoffset < 0){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_FAILURE;
     }
     else{
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 
-/* Reads from an already opened file. If there is room in the shared memory to read the file the current thread will wait for a callback
- * till the reading is done. A new thread is scheduled.*/
-TVMStatus VMFileRead(int filedescriptor, void *data, int *length){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+/* File transfers go through a bounce buffer in the shared space, as big as the transfer if there is room. The
+ * space is split evenly between the threads holding slots, and a slot leaves enough behind for one more, so a
+ * transfer that blocks, like a read of the terminal, doesn't hold up everyone else. Returns 0 if the slot would
+ * be too small to be worth taking and another will free up.*/
+int ioBufferSize(int length){
+    TVMMemorySize largest = poolLargestFree(MemoryPoolList[0]);
+    TVMMemorySize share = VMSharedSize / (SharedSlots + 1);
+    TVMMemorySize size = length;
 
-    if(data == NULL || length == NULL){
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    if(largest >= 2 * VM_IO_SLOT_MIN){
+        largest -= VM_IO_SLOT_MIN;
     }
-    else{
-        int IOThreadID = CurThreadID;
-        TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-        void *sharedBase;
+    else if(SharedSlots > 0 && largest < VM_IO_SLOT_MIN){
+        return 0;
+    }
+    if(size > share){
+        size = share;
+    }
+    if(size > largest){
+        size = largest;
+    }
+    return size;
+}
 
-        if(sharedLock.locked){
-            if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                sharedLock.highMuxQ.push(CurThreadID);
-            }
-            else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                sharedLock.medMuxQ.push(CurThreadID);
-            }
-            else{
-                sharedLock.lowMuxQ.push(CurThreadID);
-            }
-            VMSchedule();
-            VMMemoryPoolAllocate(0, 512, &sharedBase);
+/* Takes a slot for a transfer of length bytes and returns its size. Threads that find the shared space used up
+ * wait in SharedWaiters, and each one that gets a slot passes the wakeup on while there is room left. Returns 0
+ * without waiting if no other thread holds a slot, as then nothing would ever give room back.*/
+int ioBufferGet(int length, void **bufref){
+    int size = ioBufferSize(length);
+    while(size <= 0 || VMMemoryPoolAllocate(0, size, bufref) != VM_STATUS_SUCCESS){
+        if(SharedSlots == 0){
+            return 0;
         }
-        else if(VMMemoryPoolAllocate(0, 512, &sharedBase) != VM_STATUS_SUCCESS) {
-            sharedLock.locked = true;
-            if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                sharedLock.highMuxQ.push(CurThreadID);
-            }
-            else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                sharedLock.medMuxQ.push(CurThreadID);
-            }
-            else{
-                sharedLock.lowMuxQ.push(CurThreadID);
-            }
-            VMSchedule();
-            VMMemoryPoolAllocate(0, 512, &sharedBase);
-        }
-        int originalLength = *length;
-        int bytesToRead = *length;
-        *length = 0;
-        while(bytesToRead > 0){
-            if(bytesToRead > 512){
-                TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-                MachineFileRead(filedescriptor, sharedBase, 512, IOCallback, &IOThreadID);
-                VMSchedule();
-                if(TCBList[IOThreadID].retVal < 0){
-                    MachineResumeSignals(&sigState);
-                    return VM_STATUS_FAILURE;
-                }
-                else{
-                    *length += TCBList[IOThreadID].retVal;
+        threadWait(SharedWaiters, VM_TIMEOUT_INFINITE);
+        size = ioBufferSize(length);
+    }
+    SharedSlots++;
+    TCBList[CurThreadID].io->slot = *bufref;
+    if(SharedWaiters.bitmap != 0 && ioBufferSize(VM_IO_SLOT_MIN) > 0){
+        threadWakeOne(SharedWaiters);
+    }
+    return size;
+}
+
+/*Gives a slot back and wakes the next thread waiting for one, returns true if one was woken.*/
+bool ioBufferRelease(void *buffer){
+    VMMemoryPoolDeallocate(0, buffer);
+    SharedSlots--;
+    return threadWakeOne(SharedWaiters) != VM_THREAD_ID_INVALID;
+}
+
+/*Gives the current thread's slot back.*/
+void ioBufferPut(void *buffer){
+    TCBList[CurThreadID].io->slot = NULL;
+    if(ioBufferRelease(buffer)){
+        VMSchedule();
+    }
+}
+
+/* Detaches the requests of a thread being terminated. Any still in flight are orphaned along with the slot, which
+ * the last of them gives back, otherwise the slot is given back now.*/
+void ioThreadOrphan(TVMThreadID thread){
+    IOContext *context = TCBList[thread].io;
+    if(context->inFlight > 0){
+        context->orphaned = true;
+        TCBList[thread].io = ioContextCreate();
+    }
+    else if(context->slot != NULL){
+        ioBufferRelease(context->slot);
+        context->slot = NULL;
+    }
+}
+
+/* Moves length bytes between data and the file through the thread's slot of the shared space, or straight to and
+ * from data if it is already in the shared space. With more than one processor a large transfer is split into up
+ * to IOPipelineDepth pieces that are all kept in flight, so the machine works on the next piece while this one is
+ * copied. Every piece after the first is chained to the one before it, and comes back empty instead of being
+ * carried out once one is short, which ends the transfer just as a short read or write did one at a time.*/
+TVMStatus ioTransfer(int filedescriptor, uint8_t *data, int *length, bool writing, bool direct){
+    IOChunk *chunks = TCBList[CurThreadID].io->chunks;
+    TVMStatus status = VM_STATUS_SUCCESS;
+    int total = *length;
+    int issued = 0, finished = 0, offset = 0;
+    bool stopped = false;
+    void *sharedBase;
+
+    *length = 0;
+    if(total <= 0){
+        return VM_STATUS_SUCCESS;
+    }
+    int bufferSize = direct ? total : ioBufferGet(total, &sharedBase);
+    if(bufferSize <= 0){
+        return VM_STATUS_FAILURE;
+    }
+    int chunkSize = bufferSize / IOPipelineDepth;
+    if(chunkSize < VM_IO_CHUNK_MIN){
+        chunkSize = VM_IO_CHUNK_MIN < bufferSize ? VM_IO_CHUNK_MIN : bufferSize;
+    }
+    int chunkCount = bufferSize / chunkSize;
+    while(true){
+        if(!stopped && issued == finished && offset < total){
+            ioRequestWait();
+        }
+        MachineFileBatchBegin();
+        while(!stopped && issued - finished < chunkCount && offset < total && IORequests < VM_IO_REQUEST_LIMIT){
+            IOChunk &chunk = chunks[issued % chunkCount];
+            ioChunkInit(chunk);
+            chunk.buffer = direct ? data + offset : (uint8_t *)sharedBase + (issued % chunkCount) * chunkSize;
+            chunk.length = total - offset < chunkSize ? total - offset : chunkSize;
+            if(writing){
+                if(!direct){
+                    memcpy(chunk.buffer, data + offset, chunk.length);
                 }
-                memcpy(data, sharedBase, 512);
-                data = (uint8_t *)data + 512;
-                bytesToRead -= 512;
+                (issued ? MachineFileWriteChained : MachineFileWrite)(filedescriptor, chunk.buffer, chunk.length, IOChunkCallback, &chunk);
             }
             else{
-                TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-                MachineFileRead(filedescriptor, sharedBase, bytesToRead, IOCallback, &IOThreadID);
-                VMSchedule();
-                if(TCBList[IOThreadID].retVal < 0){
-                    MachineResumeSignals(&sigState);
-                    return VM_STATUS_FAILURE;
-                }
-                else{
-                    *length += TCBList[IOThreadID].retVal;
-                }
-                memcpy(data, sharedBase, bytesToRead);
-                data = (uint8_t *)data + bytesToRead;
-                bytesToRead = 0;
+                (issued ? MachineFileReadChained : MachineFileRead)(filedescriptor, chunk.buffer, chunk.length, IOChunkCallback, &chunk);
             }
+            offset += chunk.length;
+            issued++;
         }
-        data = (uint8_t *)data - originalLength;
-        VMMemoryPoolDeallocate(0, sharedBase);
-        if(sharedLock.highMuxQ.empty() && sharedLock.medMuxQ.empty() && sharedLock.lowMuxQ.empty()){
-            sharedLock.locked = false;
+        MachineFileBatchEnd();
+        if(finished == issued){
+            break;
         }
-        else{
-            if(!sharedLock.highMuxQ.empty()){
-                TCBList[sharedLock.highMuxQ.front()].state = VM_THREAD_STATE_READY;
-                pushThreadToCorrectQ(sharedLock.highMuxQ.front());
-                sharedLock.highMuxQ.pop();
-            }
-            else if(!sharedLock.medMuxQ.empty()){
-                TCBList[sharedLock.medMuxQ.front()].state = VM_THREAD_STATE_READY;
-                pushThreadToCorrectQ(sharedLock.medMuxQ.front());
-                sharedLock.medMuxQ.pop();
+        IOChunk &chunk = chunks[finished % chunkCount];
+        int result = ioChunkWait(chunk);
+        if(!stopped){
+            if(result < 0){
+                status = VM_STATUS_FAILURE;
+                stopped = true;
             }
             else{
-                TCBList[sharedLock.lowMuxQ.front()].state = VM_THREAD_STATE_READY;
-                pushThreadToCorrectQ(sharedLock.lowMuxQ.front());
-                sharedLock.lowMuxQ.pop();
+                if(!writing && !direct){
+                    memcpy(data + *length, chunk.buffer, result);
+                }
+                *length += result;
+                stopped = result < chunk.length;
             }
-            VMSchedule();
         }
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_SUCCESS;
+        finished++;
     }
+    if(!direct){
+        ioBufferPut(sharedBase);
+    }
+    return status;
+}
+
+/* Reads from an already opened file. The current thread waits while the pieces of the read are in flight, a new
+ * thread is scheduled meanwhile. A short read ends the transfer early.*/
+TVMStatus VMFileRead(int filedescriptor, void *data, int *length){
+    VMCriticalEnter();
+
+    if(data == NULL || length == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMStatus status = ioTransfer(filedescriptor, (uint8_t *)data, length, false, false);
+    VMCriticalLeave();
+    return status;
 }
 
-/* Writes to an already opened file. If there is room in the shared memory to write to the file the current thread will wait for a callback
- * till the writing is done. A new thread is scheduled.*/
+/* Writes to an already opened file. The current thread waits while the pieces of the write are in flight, a new
+ * thread is scheduled meanwhile. A short write ends the transfer early.*/
 TVMStatus VMFileWrite(int filedescriptor, void *data, int *length){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
 
     if(data == NULL || length == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
-    else{
-        int IOThreadID = CurThreadID;
-        TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-        void *sharedBase;
-        if(sharedLock.locked){
-            //cout << "sharedLock is locked\n";
-            if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                sharedLock.highMuxQ.push(CurThreadID);
-            }
-            else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                sharedLock.medMuxQ.push(CurThreadID);
-            }
-            else{
-                sharedLock.lowMuxQ.push(CurThreadID);
-            }
-            VMSchedule();
-            VMMemoryPoolAllocate(0, 512, &sharedBase);
-        }
-        else if(VMMemoryPoolAllocate(0, 512, &sharedBase) != VM_STATUS_SUCCESS) {
-            sharedLock.locked = true;
-            if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                sharedLock.highMuxQ.push(CurThreadID);
-            }
-            else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                sharedLock.medMuxQ.push(CurThreadID);
-            }
-            else{
-                sharedLock.lowMuxQ.push(CurThreadID);
-            }
-            VMSchedule();
-            VMMemoryPoolAllocate(0, 512, &sharedBase);
-        }
-        int originalLength = *length;
-        int bytesToWrite = *length;
-        *length = 0;
-        while(bytesToWrite > 0){
-            if(bytesToWrite > 512){
-                memcpy(sharedBase, data, 512);
-                TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-                MachineFileWrite(filedescriptor, sharedBase, 512, IOCallback, &IOThreadID);
-                VMSchedule();
-                if(TCBList[IOThreadID].retVal < 0){
-                    MachineResumeSignals(&sigState);
-                    return VM_STATUS_FAILURE;
-                }
-                else{
-                    *length += TCBList[IOThreadID].retVal;
-                }
-                data = (uint8_t *)data + 512;
-                bytesToWrite -= 512;
-            }
-            else{
-                memcpy(sharedBase, data, (size_t)bytesToWrite);
-                TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
-                MachineFileWrite(filedescriptor, sharedBase, bytesToWrite, IOCallback, &IOThreadID);
-                VMSchedule();
-                if(TCBList[IOThreadID].retVal < 0){
-                    MachineResumeSignals(&sigState);
-                    return VM_STATUS_FAILURE;
-                }
-                else{
-                    *length += TCBList[IOThreadID].retVal;
-                }
-                data = (uint8_t *)data + bytesToWrite;
-                bytesToWrite = 0;
-            }
-        }
-        data = (uint8_t *)data - originalLength;
+    TVMStatus status = ioTransfer(filedescriptor, (uint8_t *)data, length, true, false);
+    VMCriticalLeave();
+    return status;
+}
 
-        VMMemoryPoolDeallocate(0, sharedBase);
-        if(sharedLock.highMuxQ.empty() && sharedLock.medMuxQ.empty() && sharedLock.lowMuxQ.empty()){
-            sharedLock.locked = false;
-        }
-        else{
-            if(!sharedLock.highMuxQ.empty()){
-                TCBList[sharedLock.highMuxQ.front()].state = VM_THREAD_STATE_READY;
-                pushThreadToCorrectQ(sharedLock.highMuxQ.front());
-                sharedLock.highMuxQ.pop();
-            }
-            else if(!sharedLock.medMuxQ.empty()){
-                TCBList[sharedLock.medMuxQ.front()].state = VM_THREAD_STATE_READY;
-                pushThreadToCorrectQ(sharedLock.medMuxQ.front());
-                sharedLock.medMuxQ.pop();
-            }
-            else{
-                TCBList[sharedLock.lowMuxQ.front()].state = VM_THREAD_STATE_READY;
-                pushThreadToCorrectQ(sharedLock.lowMuxQ.front());
-                sharedLock.lowMuxQ.pop();
-            }
-            VMSchedule();
-        }
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_SUCCESS;
+/* Shared buffers come out of the shared space, so the machine can read into them and write from them directly
+ * and transfers through VMFileReadShared and VMFileWriteShared skip the copy through a bounce buffer. A buffer
+ * always leaves a free block of VM_IO_SLOT_MIN behind, so ordinary transfers still get a slot.*/
+TVMStatus VMSharedBufferAllocate(TVMMemorySize size, void **pointer){
+    VMCriticalEnter();
+    if(size == 0 || pointer == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    void *base = poolAllocate(MemoryPoolList[0], size, 0);
+    if(base != NULL && poolLargestFree(MemoryPoolList[0]) < VM_IO_SLOT_MIN){
+        poolDeallocate(MemoryPoolList[0], base);
+        base = NULL;
     }
+    if(base == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    SharedBuffers.insert((uint8_t *)base);
+    *pointer = base;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
 }
 
-TVMStatus VMFileClose(int filedescriptor){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+/*The largest shared buffer that can be allocated now and still leave the IO slot reserve.*/
+TVMStatus VMSharedBufferQuery(TVMMemorySizeRef bytesleft){
+    VMCriticalEnter();
+    if(bytesleft == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMMemorySize largest = poolLargestFree(MemoryPoolList[0]);
+    *bytesleft = largest > VM_IO_SLOT_MIN ? (largest - VM_IO_SLOT_MIN) & ~(TVMMemorySize)(VM_POOL_GRANULE - 1) : 0;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
 
-    int IOThreadID = CurThreadID;
-    TCBList[IOThreadID].state = VM_THREAD_STATE_WAITING;
+/*Gives a shared buffer back, a thread waiting for room in the shared space may now get it.*/
+TVMStatus VMSharedBufferRelease(void *pointer){
+    VMCriticalEnter();
+    if(pointer == NULL || SharedBuffers.erase((uint8_t *)pointer) == 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    poolDeallocate(MemoryPoolList[0], pointer);
+    if(threadWakeOne(SharedWaiters) != VM_THREAD_ID_INVALID){
+        VMSchedule();
+    }
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
 
-    MachineFileClose(filedescriptor, IOCallback, &IOThreadID);
+/* True if length bytes at data all lie in one buffer from VMSharedBufferAllocate. Anything else in the shared
+ * space, like another thread's bounce buffer, or a range running from one buffer into the next, doesn't count.*/
+bool ioSharedRange(void *data, int length){
+    set<uint8_t *>::iterator found = SharedBuffers.upper_bound((uint8_t *)data);
+    if(length < 0 || found == SharedBuffers.begin()){
+        return false;
+    }
+    uint8_t *block = *--found;
+    TVMMemorySize offset = (uint8_t *)data - block;
+    TVMMemorySize size = poolBlockSize(MemoryPoolList[0], block);
+    return offset < size && (TVMMemorySize)length <= size - offset;
+}
 
-    VMSchedule();
-    if(TCBList[IOThreadID].retVal < 0){
-        MachineResumeSignals(&sigState);
+/* Reads into a shared buffer with no copy on the way. Otherwise the same as VMFileRead, data has to be inside a
+ * buffer from VMSharedBufferAllocate.*/
+TVMStatus VMFileReadShared(int filedescriptor, void *data, int *length){
+    VMCriticalEnter();
+
+    if(data == NULL || length == NULL || !ioSharedRange(data, *length)){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMStatus status = ioTransfer(filedescriptor, (uint8_t *)data, length, false, true);
+    VMCriticalLeave();
+    return status;
+}
+
+/* Writes from a shared buffer with no copy on the way. Otherwise the same as VMFileWrite, data has to be inside a
+ * buffer from VMSharedBufferAllocate.*/
+TVMStatus VMFileWriteShared(int filedescriptor, void *data, int *length){
+    VMCriticalEnter();
+
+    if(data == NULL || length == NULL || !ioSharedRange(data, *length)){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMStatus status = ioTransfer(filedescriptor, (uint8_t *)data, length, true, true);
+    VMCriticalLeave();
+    return status;
+}
+
+TVMStatus VMFileClose(int filedescriptor){
+    VMCriticalEnter();
+
+    IOChunk &request = TCBList[CurThreadID].io->chunks[0];
+    ioRequestWait();
+    ioChunkInit(request);
+    MachineFileClose(filedescriptor, IOChunkCallback, &request);
+    if(ioChunkWait(request) < 0){
+        VMCriticalLeave();
         return VM_STATUS_FAILURE;
     }
     else {
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
+/* Thread stacks come out of the system pool. A stack of at least VM_STACK_GUARD_MIN gets a page aligned stack
+ * with an inaccessible guard page under it, which costs two extra pages, smaller ones are sized as before.
+ * With a huge page heap there are no guard pages, protecting one page would split the huge page around it.*/
+TVMMemorySize stackClassSize(TVMMemorySize memsize){
+    if(memsize < VM_STACK_GUARD_MIN || VMOptionHugePages){
+        return (memsize + 63) & ~(TVMMemorySize)63;
+    }
+    return ((memsize + VMPageSize - 1) & ~(VMPageSize - 1)) + 2 * VMPageSize;
+}
+
+bool stackGuarded(TVMMemorySize stackClass){
+    return stackClass > VM_STACK_GUARD_MIN && !VMOptionHugePages;
+}
+
+uint8_t *stackGuardPage(void *stackAlloc){
+    return (uint8_t *)(((uintptr_t)stackAlloc + VMPageSize - 1) & ~(uintptr_t)(VMPageSize - 1));
+}
+
+/* Sets the thread's stack fields up from its allocation.*/
+void stackAssign(TCB &thread, void *stackAlloc, TVMMemorySize stackClass, TVMMemorySize memsize){
+    thread.stackAlloc = stackAlloc;
+    thread.stackClass = stackClass;
+    if(stackAlloc != NULL && stackGuarded(stackClass)){
+        thread.stackaddr = stackGuardPage(stackAlloc) + VMPageSize;
+        thread.stacksize = stackClass - 2 * VMPageSize;
+    }
+    else{
+        thread.stackaddr = stackAlloc;
+        thread.stacksize = memsize;
+    }
+}
+
+/* Takes a cached stack of the right size if there is one, otherwise allocates and guards a new one. NULL if
+ * the system pool is out of room.*/
+void *stackGet(TVMMemorySize stackClass){
+    StackCacheClass &cached = StackCache[stackClass];
+    if(!cached.stacks.empty()){
+        void *stackAlloc = cached.stacks.back();
+        cached.stacks.pop_back();
+        if(cached.trimmed > cached.stacks.size()){
+            cached.trimmed = cached.stacks.size();
+        }
+        StackCacheBytes -= stackClass;
+        return stackAlloc;
+    }
+    void *stackAlloc;
+    if(VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, stackClass, &stackAlloc) != VM_STATUS_SUCCESS){
+        return NULL;
+    }
+    if(stackGuarded(stackClass)){
+        mprotect(stackGuardPage(stackAlloc), VMPageSize, PROT_NONE);
+    }
+    return stackAlloc;
+}
+
+/* Hands the pages of a cached stack back to the OS, apart from the top VM_STACK_WARM_SIZE which every thread
+ * touches. The rest is only committed again if a thread grows into it. Huge pages are left whole.*/
+void stackTrim(void *stackAlloc, TVMMemorySize stackClass){
+    if(VMOptionHugePages){
+        return;
+    }
+    uint8_t *first = stackGuardPage(stackAlloc);
+    uint8_t *last = (uint8_t *)(((uintptr_t)stackAlloc + stackClass - VM_STACK_WARM_SIZE) & ~(uintptr_t)(VMPageSize - 1));
+    if(stackGuarded(stackClass)){
+        first += VMPageSize;
+    }
+    if(first < last){
+        madvise(first, last - first, MADV_DONTNEED);
+    }
+}
+
+/* Caches a deleted thread's stack. The cache is a stack itself, so the last VM_STACK_CACHE_HOT stacks put back
+ * are the next ones reused and are left as they are, a stack is trimmed once it drops below them.*/
+void stackPut(void *stackAlloc, TVMMemorySize stackClass){
+    if(stackAlloc == NULL){
+        return;
+    }
+    StackCacheClass &cached = StackCache[stackClass];
+    cached.stacks.push_back(stackAlloc);
+    StackCacheBytes += stackClass;
+    while(cached.stacks.size() - cached.trimmed > VM_STACK_CACHE_HOT){
+        stackTrim(cached.stacks[cached.trimmed], stackClass);
+        cached.trimmed++;
+    }
+}
+
+/* Returns every cached stack to the system pool, used when an allocation from it would otherwise fail. Returns
+ * false if there was nothing to give back.*/
+bool stackCacheFlush(){
+    if(StackCacheBytes == 0){
+        return false;
+    }
+    for(map<TVMMemorySize, StackCacheClass>::iterator it = StackCache.begin(); it != StackCache.end(); it++){
+        for(unsigned int i = 0; i < it->second.stacks.size(); i++){
+            if(stackGuarded(it->first)){
+                mprotect(stackGuardPage(it->second.stacks[i]), VMPageSize, PROT_READ | PROT_WRITE);
+            }
+            VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, it->second.stacks[i]);
+        }
+        it->second.stacks.clear();
+        it->second.trimmed = 0;
+    }
+    StackCacheBytes = 0;
+    return true;
+}
+
 TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsize, TVMThreadPriority prio, TVMThreadIDRef tid){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(entry == NULL || tid == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
-        if(prio != 0){
-            if(TCBList.size() > 2){
-                for(unsigned int i = 2; i < TCBList.size(); i++){
-                    if(TCBList[i].sleepTicks == -1){ //SLEEPTICKS IS WHAT WE WILL USE TO TRACK DEAD THREADS
-                        *tid = i;
-                        break;
-                    }
-                }
-                *tid = TCBList.size();
-            }
-            else{
-                *tid = 2;
-            }
+        /*Slots of deleted threads are reused, the generation they carry over keeps the old IDs invalid.*/
+        TVMThreadID slot = threadSlotAlloc();
+        if(slot == VM_THREAD_ID_INVALID){
+            VMCriticalLeave();
+            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
         }
         //SMachineContext cont;
         TVMThreadState state = VM_THREAD_STATE_DEAD;
-        void * stackAddr;
+        TVMMemorySize stackClass = stackClassSize(memsize);
         ////cout << "Allocating " << memsize << " bytes from the main memory pool\n";
-        VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, memsize, &stackAddr);
-        if(*tid == TCBList.size()){
-            ////cout << "Creating thread " << *tid << " with priority " << prio <<"\n";
-            TCB currThread = {*tid, entry, param, stackAddr, memsize, 0, state, prio, 0, 0};
-            currThread.prio = prio;
-            TCBList.push_back(currThread);
-        }
-        else{
-            TCBList[*tid] = {*tid, entry, param, stackAddr, memsize, 0, state, prio, 0, 0};
-            TCBList[*tid].prio = prio;
+        void * stackAlloc = stackGet(stackClass);
+        if(stackAlloc == NULL){
+            /*The slot was never handed out, so it goes straight back without a new generation.*/
+            TCBList[slot].deleted = true;
+            TCBFreeList.push_back(slot);
+            VMCriticalLeave();
+            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
         }
-        MachineResumeSignals(&sigState);
+        ////cout << "Creating thread " << slot << " with priority " << prio <<"\n";
+        unsigned int generation = TCBList[slot].generation;
+        IOContext *io = TCBList[slot].io;
+        TCBList[slot] = {slot, entry, param, NULL, 0, {}, state, prio, 0, 0, VM_THREAD_ID_INVALID, VM_THREAD_ID_INVALID, 0, 0, VM_THREAD_ID_INVALID, VM_THREAD_ID_INVALID, -1, 0, 0, NULL, false, prio, VM_MUTEX_ID_INVALID, NULL, generation, NULL, 0, {}, 0, io};
+        threadQueueInit(TCBList[slot].joiners);
+        stackAssign(TCBList[slot], stackAlloc, stackClass, memsize);
+        *tid = threadHandle(slot);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMThreadActivate(TVMThreadID thread){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    if(thread >= TCBList.size() || thread < 0 || TCBList[thread].sleepTicks == -1){
-        MachineResumeSignals(&sigState);
+    VMCriticalEnter();
+    thread = threadSlot(thread);
+    if(thread == VM_THREAD_ID_INVALID){
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(TCBList[thread].state != VM_THREAD_STATE_DEAD){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_STATE;
-    }else if(thread == 0){
+    }else if(isIdleThread(thread)){
         ////cout << "\nActivating the Idle thread \n";
         TCBList[thread].state = VM_THREAD_STATE_READY;
         MachineContextCreate(&(TCBList[thread].cont), VMIdleThread, &(TCBList[thread].id),
                              TCBList[thread].stackaddr, TCBList[thread].stacksize);
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
 
     }
     else{
       //cout << "Activating " << thread << endl;
         TCBList[thread].state = VM_THREAD_STATE_READY;
+        TCBList[thread].prio = TCBList[thread].basePrio;
+        TCBList[thread].waitMutex = VM_MUTEX_ID_INVALID;
+        TCBList[thread].exitCode = 0;
         MachineContextCreate(&(TCBList[thread].cont), skeleton, &(TCBList[thread].id),
                              TCBList[thread].stackaddr, TCBList[thread].stacksize);
         pushThreadToCorrectQ(thread);
         if(TCBList[thread].prio > TCBList[CurThreadID].prio){ //this if is totally new not positive it is correct. But I think it is.
           VMSchedule();
         }
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
+/*The worker the thread is running on, NULL if it isn't running.*/
+Worker *threadOwner(TVMThreadID id){
+    for(unsigned int i = 0; i < Workers.size(); i++){
+        if(Workers[i]->curThread == id){
+            return Workers[i];
+        }
+    }
+    return NULL;
+}
+
+/* Wakes every thread joined on one that just died, handing each the exit code through its retVal.*/
+void threadWakeJoiners(TVMThreadID id){
+    TVMThreadID joiner;
+    while((joiner = threadWakeOne(TCBList[id].joiners)) != VM_THREAD_ID_INVALID){
+        TCBList[joiner].retVal = TCBList[id].exitCode;
+    }
+}
+
 TVMStatus VMThreadTerminate(TVMThreadID thread){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     ////cout << "\nThread "<< thread << " has been terminated\n";
-    if(thread >= TCBList.size() || thread < 0 || TCBList[thread].sleepTicks == -1){
-        MachineResumeSignals(&sigState);
+    thread = threadSlot(thread);
+    if(thread == VM_THREAD_ID_INVALID){
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(TCBList[thread].state == VM_THREAD_STATE_DEAD){
         ////cout << "\nA DEAD THREAD " << thread << " TRIED TO BE TERMINATED\n";
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_STATE;
     }
     else if(TCBList[thread].state == VM_THREAD_STATE_WAITING){
         ////cout << "\nA WAITING THREAD " << thread << " IS ABOUT TO BE TERMINATED\n";
         TCBList[thread].state = VM_THREAD_STATE_DEAD;
-        for(unsigned int i = 0; i < SleepyThreads.size(); i++){
-            if(SleepyThreads[i] == thread){
-                TCBList[thread].sleepTicks = 0;
-                SleepyThreads.erase(SleepyThreads.begin() + i);
-                break;
-            }
+        timerWheelCancel(SleepWheel, thread);
+        ioThreadOrphan(thread);
+        if(TCBList[thread].waitQueue != NULL){
+            threadQueueRemove(*TCBList[thread].waitQueue, thread);
+            TCBList[thread].waitQueue = NULL;
+        }
+        if(TCBList[thread].waitMutex != VM_MUTEX_ID_INVALID){
+            TVMMutexID waitMutex = TCBList[thread].waitMutex;
+            TCBList[thread].waitMutex = VM_MUTEX_ID_INVALID;
+            priorityRecompute(MuxList[waitMutex].ownerID);
         }
         if(!MuxList.empty()){
             for (unsigned int mutex = 0; mutex < MuxList.size(); mutex++) {
@@ -681,8 +1772,9 @@ TVMStatus VMThreadTerminate(TVMThreadID thread){
                 }
             }
         }
+        threadWakeJoiners(thread);
         VMSchedule();
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
     else if(TCBList[thread].state == VM_THREAD_STATE_RUNNING){
@@ -696,52 +1788,25 @@ TVMStatus VMThreadTerminate(TVMThreadID thread){
                 }
             }
         }
+        /* Running on another worker, which is kicked so it switches the thread out. Nothing joined on it is woken
+         * and this doesn't return until it is off the processor, or it could be deleted while still running.*/
+        if(thread != CurThreadID){
+            Worker *owner = threadOwner(thread);
+            while(owner != NULL && owner->curThread == thread){
+                MachineKickProcessor(owner->index);
+                threadWait(SwitchOutWaiters, VM_TIMEOUT_INFINITE);
+            }
+        }
+        threadWakeJoiners(thread);
         VMSchedule();
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
     else{
         ////cout << "\nA READY THREAD " << thread << " IS ABOUT TO BE TERMINATED\n";
         TCBList[thread].state = VM_THREAD_STATE_DEAD;
-        if(TCBList[thread].prio == VM_THREAD_PRIORITY_HIGH){
-            unsigned long qSize = HighPriorityQ.size();
-            for(unsigned long i = 0; i < qSize; i++){
-                if(HighPriorityQ.front() == thread){
-                    HighPriorityQ.pop();
-                }
-                else{
-                    TVMThreadID temp = HighPriorityQ.front();
-                    HighPriorityQ.pop();
-                    HighPriorityQ.push(temp);
-                }
-            }
-        }
-        else if(TCBList[thread].prio == VM_THREAD_PRIORITY_NORMAL){
-            unsigned long qSize = MedPriorityQ.size();
-            for(unsigned long i = 0; i < qSize; i++){
-                if(MedPriorityQ.front() == thread){
-                    MedPriorityQ.pop();
-                }
-                else{
-                    TVMThreadID temp = MedPriorityQ.front();
-                    MedPriorityQ.pop();
-                    MedPriorityQ.push(temp);
-                }
-            }
-        }
-        else{
-            unsigned long qSize = LowPriorityQ.size();
-            for(unsigned long i = 0; i < qSize; i++){
-                if(LowPriorityQ.front() == thread){
-                    LowPriorityQ.pop();
-                }
-                else{
-                    TVMThreadID temp = LowPriorityQ.front();
-                    LowPriorityQ.pop();
-                    LowPriorityQ.push(temp);
-                }
-            }
-        }
+        threadQueueRemove(*TCBList[thread].queuedOn, thread);
+        ioThreadOrphan(thread);
         if(!MuxList.empty()){
             for (unsigned int mutex = 0; mutex < MuxList.size(); mutex++) {
                 if(MuxList[mutex].ownerID == thread){
@@ -750,128 +1815,202 @@ TVMStatus VMThreadTerminate(TVMThreadID thread){
                 }
             }
         }
+        threadWakeJoiners(thread);
         VMSchedule();
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+/* Terminates the calling thread, anything joined on it gets exitcode.*/
+TVMStatus VMThreadExit(int exitcode){
+    VMCriticalEnter();
+    TCBList[CurThreadID].exitCode = exitcode;
+    TVMStatus status = VMThreadTerminate(threadHandle(CurThreadID));
+    VMCriticalLeave();
+    return status;
+}
+
+/* Waits for a thread to die and gets its exit code. The caller blocks on the thread's joiners list and is woken
+ * directly by VMThreadTerminate, a thread that is already dead returns straight away.*/
+TVMStatus VMThreadJoin(TVMThreadID thread, TVMTick timeout, int *exitref){
+    VMCriticalEnter();
+    thread = threadSlot(thread);
+    if(thread == VM_THREAD_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(exitref == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    else if(thread == CurThreadID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_STATE;
+    }
+    else if(TCBList[thread].state == VM_THREAD_STATE_DEAD){
+        *exitref = TCBList[thread].exitCode;
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+    else if(timeout == VM_TIMEOUT_IMMEDIATE){
+        VMCriticalLeave();
+        return VM_STATUS_FAILURE;
+    }
+    else{
+        if(!threadWait(TCBList[thread].joiners, timeout)){
+            VMCriticalLeave();
+            return VM_STATUS_FAILURE;
+        }
+        *exitref = TCBList[CurThreadID].retVal;
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMThreadSleep(TVMTick tick){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(tick == VM_TIMEOUT_INFINITE){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else if(tick == VM_TIMEOUT_IMMEDIATE){
         TCBList[CurThreadID].state = VM_THREAD_STATE_READY;
         pushThreadToCorrectQ(CurThreadID);
         VMSchedule();
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
     else{
         TCBList[CurThreadID].state = VM_THREAD_STATE_WAITING;
-        TCBList[CurThreadID].sleepTicks = tick;
-        SleepyThreads.push_back(CurThreadID);
+        timerWheelInsert(SleepWheel, CurThreadID, tick);
         VMSchedule();
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMThreadState(TVMThreadID thread, TVMThreadStateRef state){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
 
-    if(thread >= TCBList.size() || thread < 0 || TCBList[thread].sleepTicks == -1){ //IF THREAD IS DELETED, GIVE ERROR INVALID ID
-        MachineResumeSignals(&sigState);
+    thread = threadSlot(thread);
+    if(thread == VM_THREAD_ID_INVALID){ //IF THREAD IS DELETED, GIVE ERROR INVALID ID
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(state == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
         *state = TCBList[thread].state;
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+/* Reports how much of a thread's stack is actually backed by memory, by asking the OS which of its pages are
+ * resident. Partial pages at either end count in full.*/
+TVMStatus VMThreadStackQuery(TVMThreadID thread, TVMMemorySizeRef committedref){
+    VMCriticalEnter();
+    thread = threadSlot(thread);
+    if(thread == VM_THREAD_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(committedref == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    else{
+        *committedref = 0;
+        if(TCBList[thread].stackaddr != NULL && TCBList[thread].stacksize != 0){
+            uintptr_t first = (uintptr_t)TCBList[thread].stackaddr & ~(uintptr_t)(VMPageSize - 1);
+            uintptr_t last = ((uintptr_t)TCBList[thread].stackaddr + TCBList[thread].stacksize + VMPageSize - 1) & ~(uintptr_t)(VMPageSize - 1);
+            vector<unsigned char> resident((last - first) / VMPageSize);
+            if(mincore((void *)first, last - first, resident.data()) == 0){
+                for(unsigned int i = 0; i < resident.size(); i++){
+                    if(resident[i] & 1){
+                        *committedref += VMPageSize;
+                    }
+                }
+            }
+        }
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMThreadDelete(TVMThreadID thread){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    if(thread >= TCBList.size() || thread < 0 || TCBList[thread].sleepTicks == -1){
-        MachineResumeSignals(&sigState);
+    VMCriticalEnter();
+    thread = threadSlot(thread);
+    if(thread == VM_THREAD_ID_INVALID){
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(TCBList[thread].state != VM_THREAD_STATE_DEAD){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_STATE;
     }
     else{
         TCBList[thread].entry = NULL;
         TCBList[thread].param = NULL;
-        VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, TCBList[thread].stackaddr);
-        TCBList[thread].stackaddr = NULL;
-        TCBList[thread].stacksize = 0;
+        stackPut(TCBList[thread].stackAlloc, TCBList[thread].stackClass);
+        stackAssign(TCBList[thread], NULL, 0, 0);
         TCBList[thread].state = 0;
         TCBList[thread].prio = 0;
         TCBList[thread].retVal = -1;
-        TCBList[thread].sleepTicks = -1;
-        MachineResumeSignals(&sigState);
+        TCBList[thread].deleted = true;
+        TCBList[thread].generation++;
+        TCBFreeList.push_back(thread);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMTickMS(int *tickmsref){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(tickmsref == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
         *tickmsref = tickDur;
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMTickCount(TVMTickRef tickref){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(tickref == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
         *tickref = tickCount;
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMThreadID(TVMThreadIDRef threadref){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(threadref == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
-        *threadref = CurThreadID;
-        MachineResumeSignals(&sigState);
+        *threadref = threadHandle(CurThreadID);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMMutexCreate(TVMMutexIDRef mutexref){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(mutexref == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
@@ -882,11 +2021,8 @@ TVMStatus VMMutexCreate(TVMMutexIDRef mutexref){
             }
         }
         ////cout << "Creating mutex " << newMuxID << "\n";
-        queue<TVMThreadID> tempHigh;
-        queue<TVMThreadID> tempMed;
-        queue<TVMThreadID> tempLow;
-
-        Mux newMux = {newMuxID, 0, false, tempHigh, tempMed, tempLow, false};
+        Mux newMux = {newMuxID, 0, false, {}, false};
+        threadQueueInit(newMux.waiters);
         if(newMuxID == MuxList.size()){
             MuxList.push_back(newMux);
         }
@@ -894,442 +2030,1530 @@ TVMStatus VMMutexCreate(TVMMutexIDRef mutexref){
             MuxList[newMuxID] = newMux;
         }
         *mutexref = newMuxID;
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMMutexDelete(TVMMutexID mutex){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(MuxList.empty() || mutex >= MuxList.size() || MuxList[mutex].deleted){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(MuxList[mutex].ownerID != 0){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_STATE;
     }
     else {
         MuxList[mutex].deleted = true;
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(MuxList.empty() || mutex >= MuxList.size() || MuxList[mutex].deleted){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(ownerref == NULL){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else if(!MuxList[mutex].locked){
         ////cout << "Lock is already locked!\n";
         *ownerref = VM_THREAD_ID_INVALID;
         ////cout << "set ownerref to " << *ownerref << " which should be " << VM_THREAD_ID_INVALID << "\n";
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
     else{
         ////cout << "The owner of the lock is " << MuxList[mutex].ownerID << "\n";
-        *ownerref = MuxList[mutex].ownerID;
-        MachineResumeSignals(&sigState);
+        *ownerref = threadHandle(MuxList[mutex].ownerID);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
+/* Moves a thread to a new effective priority, requeueing it at the new level if it is sitting in the ready
+ * queue or a wait queue.*/
+void threadSetPriority(TVMThreadID id, TVMThreadPriority prio){
+    if(TCBList[id].prio == prio){
+        return;
+    }
+    ThreadQueue *queue = TCBList[id].queuedOn;
+    if(queue != NULL){
+        threadQueueRemove(*queue, id);
+    }
+    TCBList[id].prio = prio;
+    if(queue != NULL){
+        threadQueuePush(*queue, id);
+    }
+}
+
+/* Priority inheritance. A thread about to block on a mutex lends its priority to the owner, and on down the
+ * chain if that owner is itself blocked on a mutex. The chain stops at the first thread already running at
+ * least as high, which also ends it on a deadlock cycle.*/
+void priorityInherit(TVMMutexID mutex){
+    TVMThreadPriority prio = TCBList[CurThreadID].prio;
+    while(mutex != VM_MUTEX_ID_INVALID){
+        TVMThreadID owner = MuxList[mutex].ownerID;
+        if(owner == 0 || TCBList[owner].prio >= prio){
+            break;
+        }
+        threadSetPriority(owner, prio);
+        mutex = TCBList[owner].waitMutex;
+    }
+}
+
+/* Works out a thread's effective priority again after the set of threads waiting on the mutexes it holds has
+ * changed. It is the higher of its own priority and the highest waiter on any mutex it owns. A change is passed
+ * on to the owner of the mutex the thread is blocked on, if any.*/
+void priorityRecompute(TVMThreadID id){
+    while(VMOptionPriorityInheritance && id != 0 && id != VM_THREAD_ID_INVALID){
+        TVMThreadPriority prio = TCBList[id].basePrio;
+        for(unsigned int mutex = 0; mutex < MuxList.size(); mutex++){
+            if(!MuxList[mutex].deleted && MuxList[mutex].ownerID == id){
+                unsigned int level = threadQueueTopLevel(MuxList[mutex].waiters);
+                if(level > prio){
+                    prio = level;
+                }
+            }
+        }
+        if(prio == TCBList[id].prio){
+            break;
+        }
+        threadSetPriority(id, prio);
+        if(TCBList[id].waitMutex == VM_MUTEX_ID_INVALID){
+            break;
+        }
+        id = MuxList[TCBList[id].waitMutex].ownerID;
+    }
+}
+
+/* Blocks the current thread until the mutex is handed to it or the timeout runs out. Returns true if the
+ * thread now owns the mutex.*/
+bool muxWait(TVMMutexID mutex, TVMTick timeout){
+    TCBList[CurThreadID].waitMutex = mutex;
+    if(VMOptionPriorityInheritance){
+        priorityInherit(mutex);
+    }
+    threadWait(MuxList[mutex].waiters, timeout);
+    if(MuxList[mutex].ownerID != CurThreadID){
+        /*Timed out, the owner may have been holding a priority lent by this thread.*/
+        TCBList[CurThreadID].waitMutex = VM_MUTEX_ID_INVALID;
+        priorityRecompute(MuxList[mutex].ownerID);
+        return false;
+    }
+    return true;
+}
+
 TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(MuxList.empty() || mutex >= MuxList.size() || MuxList[mutex].deleted){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(!MuxList[mutex].locked){
         ////cout << "Mutex " << mutex << " is unlocked\n";
         MuxList[mutex].locked = true;
         MuxList[mutex].ownerID = CurThreadID;
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
     else{
         ////cout << "Mutex " << mutex << " is locked\n";
         if(timeout == VM_TIMEOUT_IMMEDIATE){
-            MachineResumeSignals(&sigState);
+            VMCriticalLeave();
             return VM_STATUS_FAILURE;
         }
-        else if(timeout == VM_TIMEOUT_INFINITE){
-            TCBList[CurThreadID].state = VM_THREAD_STATE_WAITING;
-            if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                MuxList[mutex].highMuxQ.push(CurThreadID);
-            }
-            else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                MuxList[mutex].medMuxQ.push(CurThreadID);
-            }
-            else{
-                MuxList[mutex].lowMuxQ.push(CurThreadID);
-            }
-            VMSchedule();
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_SUCCESS;
-        }
         else{
-            TCBList[CurThreadID].state = VM_THREAD_STATE_WAITING;
-            if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                MuxList[mutex].highMuxQ.push(CurThreadID);
-            }
-            else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                MuxList[mutex].medMuxQ.push(CurThreadID);
-            }
-            else{
-                MuxList[mutex].lowMuxQ.push(CurThreadID);
-            }
-            VMThreadSleep(timeout);
-            VMSchedule();
-            if(MuxList[mutex].ownerID != CurThreadID){
-                if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_HIGH){
-                    unsigned long tempSize = MuxList[mutex].highMuxQ.size();
-                    for(unsigned int i = 0; i < tempSize; i++){
-                        if(MuxList[mutex].highMuxQ.front() == CurThreadID){
-                            MuxList[mutex].highMuxQ.pop();
-                        }
-                        else{
-                            TVMThreadID temp = MuxList[mutex].highMuxQ.front();
-                            MuxList[mutex].highMuxQ.pop();
-                            MuxList[mutex].highMuxQ.push(temp);
-                        }
-                    }
-                }
-                else if(TCBList[CurThreadID].prio == VM_THREAD_PRIORITY_NORMAL){
-                    ////cout << "Main has failed to acquire the lock\n";
-                    unsigned long tempSize = MuxList[mutex].medMuxQ.size();
-                    for(unsigned int i = 0; i < tempSize; i++){
-                        if(MuxList[mutex].medMuxQ.front() == CurThreadID){
-                            MuxList[mutex].medMuxQ.pop();
-                            ////cout << "Main is no longer waiting for the lock\n";
-                        }
-                        else{
-                            TVMThreadID temp = MuxList[mutex].medMuxQ.front();
-                            MuxList[mutex].medMuxQ.pop();
-                            MuxList[mutex].medMuxQ.push(temp);
-                        }
-                    }
-                }
-                else{
-                    unsigned long tempSize = MuxList[mutex].lowMuxQ.size();
-                    for(unsigned int i = 0; i < tempSize; i++){
-                        if(MuxList[mutex].lowMuxQ.front() == CurThreadID){
-                            MuxList[mutex].lowMuxQ.pop();
-                        }
-                        else{
-                            TVMThreadID temp = MuxList[mutex].lowMuxQ.front();
-                            MuxList[mutex].lowMuxQ.pop();
-                            MuxList[mutex].lowMuxQ.push(temp);
-                        }
-                    }
-                }
-                MachineResumeSignals(&sigState);
+            if(!muxWait(mutex, timeout)){
+                VMCriticalLeave();
                 return VM_STATUS_FAILURE;
             }
             else{
-                MachineResumeSignals(&sigState);
+                VMCriticalLeave();
                 return VM_STATUS_SUCCESS;
             }
         }
     }
 }
 
-void changeMuxOwner(TVMMutexID mutex, TVMThreadID myTurn){
-    ////cout << "Mutex " << mutex << " has been acquired by thread " << myTurn << "\n";
-    for(unsigned int i = 0; i < SleepyThreads.size(); i++){
-        if(SleepyThreads[i] == myTurn){
-            TCBList[myTurn].sleepTicks = 0;
-            SleepyThreads.erase(SleepyThreads.begin() + i);
-            break;
+/* Hands the mutex to the highest priority thread waiting on it, or unlocks it if nothing is waiting. Returns
+ * the new owner, 0 if the mutex was unlocked.*/
+TVMThreadID muxRelease(TVMMutexID mutex){
+    TVMThreadID myTurn = threadWakeOne(MuxList[mutex].waiters);
+    if(myTurn == VM_THREAD_ID_INVALID){
+        TVMThreadID oldOwner = MuxList[mutex].ownerID;
+        MuxList[mutex].ownerID = 0;
+        MuxList[mutex].locked = false;
+        if(TCBList[oldOwner].prio != TCBList[oldOwner].basePrio){
+            priorityRecompute(oldOwner);
         }
+        return 0;
     }
+    ////cout << "Mutex " << mutex << " has been acquired by thread " << myTurn << "\n";
+    TVMThreadID oldOwner = MuxList[mutex].ownerID;
     MuxList[mutex].ownerID = myTurn;
-    TCBList[myTurn].state = VM_THREAD_STATE_READY;
-    pushThreadToCorrectQ(myTurn);
+    TCBList[myTurn].waitMutex = VM_MUTEX_ID_INVALID;
+    priorityRecompute(oldOwner);
+    priorityRecompute(myTurn);
+    return myTurn;
 }
 
 TVMStatus VMMutexRelease(TVMMutexID mutex){
     ////cout << "Mutex " << mutex << " is trying to be released\n";
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
+    VMCriticalEnter();
     if(MuxList.empty() || mutex >= MuxList.size() || MuxList[mutex].deleted){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_ID;
     }
     else if(MuxList[mutex].ownerID != CurThreadID){
-        MachineResumeSignals(&sigState);
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_STATE;
     }
     else{
         ////cout << CurThreadID << " is releasing " << mutex << "\n";
-        TVMThreadID myTurn = 0;
-        if(!MuxList[mutex].highMuxQ.empty()){
-            myTurn = MuxList[mutex].highMuxQ.front();
-            MuxList[mutex].highMuxQ.pop();
-            changeMuxOwner(mutex, myTurn);
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_SUCCESS;
-        }
-        else if(!MuxList[mutex].medMuxQ.empty()){
-            ////cout << "MedMuxQ is not empty\n";
-            myTurn = MuxList[mutex].medMuxQ.front();
-            ////cout << "MedMuxQ contains" << myTurn << "\n";
-            MuxList[mutex].medMuxQ.pop();
-            changeMuxOwner(mutex, myTurn);
-            if(TCBList[myTurn].prio > TCBList[CurThreadID].prio){
-              VMSchedule();
-            }
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_SUCCESS;
-        }
-        else if(!MuxList[mutex].lowMuxQ.empty()){
-            myTurn = MuxList[mutex].lowMuxQ.front();
-            MuxList[mutex].lowMuxQ.pop();
-            changeMuxOwner(mutex, myTurn);
-            if(TCBList[myTurn].prio > TCBList[CurThreadID].prio){
-              VMSchedule();
-            }
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_SUCCESS;
+        TVMThreadPriority inherited = TCBList[CurThreadID].prio;
+        TVMThreadID myTurn = muxRelease(mutex);
+        /*A high priority thread handed the mutex waits for the next scheduling point.*/
+        if(myTurn != 0 && TCBList[myTurn].prio != VM_THREAD_PRIORITY_HIGH && TCBList[myTurn].prio > TCBList[CurThreadID].prio){
+            VMSchedule();
         }
-        else{
-            MuxList[mutex].ownerID = 0;
-            MuxList[mutex].locked = false;
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_SUCCESS;
+        else if(TCBList[CurThreadID].prio < inherited){
+            /*Dropping an inherited priority lets whatever was held off by it run.*/
+            VMSchedule();
         }
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
     }
 }
 
 
 
-TVMStatus VMMemoryPoolCreate(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    if(base == NULL || memory == NULL || size == 0){
-        MachineResumeSignals(&sigState);
+/*Makes the thread that was just woken run now if it outranks the current thread.*/
+void scheduleIfHigher(TVMThreadID woken){
+    if(woken != VM_THREAD_ID_INVALID && TCBList[woken].prio > TCBList[CurThreadID].prio){
+        VMSchedule();
+    }
+}
+
+TVMStatus VMCondCreate(TVMCondIDRef condref){
+    VMCriticalEnter();
+    if(condref == NULL){
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
-        if(*memory != VM_MEMORY_POOL_ID_SYSTEM){
-            vector<MemoryChunk> temp;
-            *memory = numPools;
-            MemoryPool TempPool = {*memory, base, size, temp};
-            numPools++;
-            MemoryPoolList.push_back(TempPool);
+        TVMCondID newCondID = CondList.size();
+        for(unsigned int i = 0; i < CondList.size(); i++){
+            if(CondList[i].deleted){
+                newCondID = i;
+            }
+        }
+        Cond newCond = {newCondID, {}, false};
+        threadQueueInit(newCond.waiters);
+        if(newCondID == CondList.size()){
+            CondList.push_back(newCond);
         }
         else{
-            vector<MemoryChunk> temp;
-            MainPool = {*memory, base, size, temp};
-            MemoryPoolList.push_back(MainPool);
+            CondList[newCondID] = newCond;
         }
-        MachineResumeSignals(&sigState);
+        *condref = newCondID;
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
 }
 
-TVMStatus VMMemoryPoolAllocate(TVMMemoryPoolID memory, TVMMemorySize size, void **pointer){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    unsigned int elemPos = 0;
-    if(memory >= numPools || size == 0 || pointer == NULL){
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INVALID_PARAMETER;
+TVMStatus VMCondDelete(TVMCondID cond){
+    VMCriticalEnter();
+    if(cond >= CondList.size() || CondList[cond].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(threadQueueTopLevel(CondList[cond].waiters) != 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_STATE;
+    }
+    else{
+        CondList[cond].deleted = true;
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+/* Releases the mutex and waits on the condition, then takes the mutex back before returning. The mutex is
+ * held again on return even if the wait timed out, in which case VM_STATUS_FAILURE is returned.*/
+TVMStatus VMCondWait(TVMCondID cond, TVMMutexID mutex, TVMTick timeout){
+    VMCriticalEnter();
+    if(cond >= CondList.size() || CondList[cond].deleted || mutex >= MuxList.size() || MuxList[mutex].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(MuxList[mutex].ownerID != CurThreadID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_STATE;
+    }
+    else if(timeout == VM_TIMEOUT_IMMEDIATE){
+        VMCriticalLeave();
+        return VM_STATUS_FAILURE;
     }
-    for(unsigned int i = 0; i <= MemoryPoolList.size(); i++){
-        if(i == MemoryPoolList.size()){
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+    else{
+        muxRelease(mutex);
+        bool signaled = threadWait(CondList[cond].waiters, timeout);
+        if(MuxList[mutex].locked){
+            muxWait(mutex, VM_TIMEOUT_INFINITE);
         }
-        else if(MemoryPoolList[i].mpID == memory){
-            elemPos = i;
-            break;
+        else{
+            MuxList[mutex].locked = true;
+            MuxList[mutex].ownerID = CurThreadID;
         }
+        VMCriticalLeave();
+        return signaled ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
     }
+}
 
-    if(size % 64 != 0){
-        size = size + 64 - (size % 64);
+TVMStatus VMCondSignal(TVMCondID cond){
+    VMCriticalEnter();
+    if(cond >= CondList.size() || CondList[cond].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
     }
-    ////cout << "Allocating " << size << " bytes from Memory Pool " << memory <<"\n";
+    else{
+        scheduleIfHigher(threadWakeOne(CondList[cond].waiters));
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
 
-    if(size > MemoryPoolList[elemPos].size){
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+TVMStatus VMCondBroadcast(TVMCondID cond){
+    VMCriticalEnter();
+    if(cond >= CondList.size() || CondList[cond].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
     }
     else{
-        if(MemoryPoolList[elemPos].memList.empty()){
-            ////cout << "Memory pool " << memory << " is empty\n";
-            *pointer = MemoryPoolList[elemPos].base;
-            MemoryChunk temp = {MemoryPoolList[elemPos].base, size, false};
-            MemoryChunk tempBack = {(uint8_t *)MemoryPoolList[elemPos].base + size, MemoryPoolList[elemPos].size - size, true};
-            MemoryPoolList[elemPos].memList.push_back(temp);
-            MemoryPoolList[elemPos].memList.push_back(tempBack);
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_SUCCESS;
-        }
-        else{
-            ////cout << "Memory pool " << memory << " is not empty\n";
-            for(unsigned int i = 0; i < MemoryPoolList[elemPos].memList.size(); i++){
-                if(MemoryPoolList[elemPos].memList[i].free && MemoryPoolList[elemPos].memList[i].size >= size){
-                    MemoryChunk temp = {MemoryPoolList[elemPos].memList[i].base, size, false};
-                    MemoryPoolList[elemPos].memList.insert(MemoryPoolList[elemPos].memList.begin() + i, temp);
-                    MemoryPoolList[elemPos].memList[i+1].base = (uint8_t *)MemoryPoolList[elemPos].memList[i+1].base + size;
-                    MemoryPoolList[elemPos].memList[i+1].size -= size;
-                    if(MemoryPoolList[elemPos].memList[i+1].size == 0){
-                        MemoryPoolList[elemPos].memList.erase(MemoryPoolList[elemPos].memList.begin() + (i + 1));
-                    }
-                    *pointer = MemoryPoolList[elemPos].memList[i].base;
-                    MachineResumeSignals(&sigState);
-                    return VM_STATUS_SUCCESS;
-                }
-            }
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+        /*The first thread woken is the highest priority one, so it is the only one that could preempt.*/
+        TVMThreadID first = threadWakeOne(CondList[cond].waiters);
+        while(threadWakeOne(CondList[cond].waiters) != VM_THREAD_ID_INVALID){
         }
+        scheduleIfHigher(first);
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
     }
 }
 
-TVMStatus VMMemoryPoolDeallocate(TVMMemoryPoolID memory, void *pointer){
-    if(memory != 0) {
-        TVMMemorySize tempBytes;
-        VMMemoryPoolQuery(memory, &tempBytes);
-        ////cout << tempBytes << " bytes in pool " << memory << "\n";
-        ////cout << "Deallocating from pool " << memory << "\n";
-    }
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    unsigned int elemPos = 0;
-    if(memory >= numPools || pointer == NULL){
-        MachineResumeSignals(&sigState);
+TVMStatus VMSemaphoreCreate(TVMSemaphoreIDRef semaphoreref, unsigned int count){
+    VMCriticalEnter();
+    if(semaphoreref == NULL){
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
-    for(unsigned int i = 0; i <= MemoryPoolList.size(); i++){
-        if(i == MemoryPoolList.size()){
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+    else{
+        TVMSemaphoreID newSemID = SemaphoreList.size();
+        for(unsigned int i = 0; i < SemaphoreList.size(); i++){
+            if(SemaphoreList[i].deleted){
+                newSemID = i;
+            }
         }
-        else if(MemoryPoolList[i].mpID == memory){
-            elemPos = i;
-            break;
+        Semaphore newSem = {newSemID, count, {}, false};
+        threadQueueInit(newSem.waiters);
+        if(newSemID == SemaphoreList.size()){
+            SemaphoreList.push_back(newSem);
+        }
+        else{
+            SemaphoreList[newSemID] = newSem;
         }
+        *semaphoreref = newSemID;
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+TVMStatus VMSemaphoreDelete(TVMSemaphoreID semaphore){
+    VMCriticalEnter();
+    if(semaphore >= SemaphoreList.size() || SemaphoreList[semaphore].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(threadQueueTopLevel(SemaphoreList[semaphore].waiters) != 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_STATE;
     }
-    if(MemoryPoolList[elemPos].memList.empty()){
-        MachineResumeSignals(&sigState);
+    else{
+        SemaphoreList[semaphore].deleted = true;
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+TVMStatus VMSemaphoreQuery(TVMSemaphoreID semaphore, unsigned int *countref){
+    VMCriticalEnter();
+    if(semaphore >= SemaphoreList.size() || SemaphoreList[semaphore].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(countref == NULL){
+        VMCriticalLeave();
         return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
     else{
-        ////cout << MemoryPoolList[elemPos].memList.size() << " blocks in pool " << memory << "\n";
-        for(unsigned int i = 0; i < MemoryPoolList[elemPos].memList.size(); i++) {
-            if(MemoryPoolList[elemPos].memList[i].base == pointer){
-                ////cout << "Removing " << i << "\n";
-                if((i  > 0 && MemoryPoolList[elemPos].memList[i - 1].free) &&
-                    (i  < MemoryPoolList[elemPos].memList.size() - 1 && MemoryPoolList[elemPos].memList[i + 1].free)){
-                    ////cout << "Before and after are free\n";
-                    MemoryPoolList[elemPos].memList[i - 1].size += MemoryPoolList[elemPos].memList[i].size + MemoryPoolList[elemPos].memList[i + 1].size;
-                    MemoryPoolList[elemPos].memList.erase(MemoryPoolList[elemPos].memList.begin() + i);
-                    MemoryPoolList[elemPos].memList.erase(MemoryPoolList[elemPos].memList.begin() + i);
-                }
-                else if(i  > 0 && MemoryPoolList[elemPos].memList[i - 1].free){
-                    ////cout << "Before is free\n";
-                    MemoryPoolList[elemPos].memList[i - 1].size += MemoryPoolList[elemPos].memList[i].size;
-                    MemoryPoolList[elemPos].memList.erase(MemoryPoolList[elemPos].memList.begin() + i);
-                }
-                else if(i  < MemoryPoolList[elemPos].memList.size() - 1 && MemoryPoolList[elemPos].memList[i + 1].free){
-                    ////cout << "After is free\n";
-                    MemoryPoolList[elemPos].memList[i].free = true;
-                    MemoryPoolList[elemPos].memList[i].size += MemoryPoolList[elemPos].memList[i + 1].size;
-                    MemoryPoolList[elemPos].memList.erase(MemoryPoolList[elemPos].memList.begin() + (i + 1));
-                }
-                else{
-                    ////cout << "neither are free\n";
-                    MemoryPoolList[elemPos].memList[i].free = true;
-                }
-                if(MemoryPoolList[elemPos].memList.size() == 1 && MemoryPoolList[elemPos].memList[0].free){
-                    ////cout << "Final element removed\n";
-                    MemoryPoolList[elemPos].memList.clear();
-                }
-                MachineResumeSignals(&sigState);
-                return VM_STATUS_SUCCESS;
+        *countref = SemaphoreList[semaphore].count;
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+/* Takes one from the count, waiting for an up if it is zero. An up with threads waiting hands its count straight
+ * to the first waiter, so a woken thread never has to check the count again.*/
+TVMStatus VMSemaphoreDown(TVMSemaphoreID semaphore, TVMTick timeout){
+    VMCriticalEnter();
+    if(semaphore >= SemaphoreList.size() || SemaphoreList[semaphore].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else if(SemaphoreList[semaphore].count != 0){
+        SemaphoreList[semaphore].count--;
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+    else if(timeout == VM_TIMEOUT_IMMEDIATE){
+        VMCriticalLeave();
+        return VM_STATUS_FAILURE;
+    }
+    else{
+        bool signaled = threadWait(SemaphoreList[semaphore].waiters, timeout);
+        VMCriticalLeave();
+        return signaled ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
+    }
+}
+
+TVMStatus VMSemaphoreUp(TVMSemaphoreID semaphore){
+    VMCriticalEnter();
+    if(semaphore >= SemaphoreList.size() || SemaphoreList[semaphore].deleted){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_ID;
+    }
+    else{
+        TVMThreadID woken = threadWakeOne(SemaphoreList[semaphore].waiters);
+        if(woken == VM_THREAD_ID_INVALID){
+            SemaphoreList[semaphore].count++;
+        }
+        scheduleIfHigher(woken);
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+
+/*Returns the free list a chunk of this size belongs on.*/
+unsigned int poolBin(TVMMemorySize size){
+    TVMMemorySize granules = size / VM_POOL_GRANULE;
+    if(granules == 0){
+        return 0;
+    }
+    return 31 - __builtin_clz(granules);
+}
+
+void poolBinInsert(MemoryPool &pool, unsigned int id){
+    unsigned int bin = poolBin(pool.memList[id].size);
+    pool.memList[id].binPrev = VM_CHUNK_NONE;
+    pool.memList[id].binNext = pool.bins[bin];
+    if(pool.bins[bin] != VM_CHUNK_NONE){
+        pool.memList[pool.bins[bin]].binPrev = id;
+    }
+    pool.bins[bin] = id;
+    pool.binMap |= 1U << bin;
+}
+
+void poolBinRemove(MemoryPool &pool, unsigned int id){
+    unsigned int bin = poolBin(pool.memList[id].size);
+    MemoryChunk &chunk = pool.memList[id];
+    if(chunk.binPrev == VM_CHUNK_NONE){
+        pool.bins[bin] = chunk.binNext;
+    }
+    else{
+        pool.memList[chunk.binPrev].binNext = chunk.binNext;
+    }
+    if(chunk.binNext != VM_CHUNK_NONE){
+        pool.memList[chunk.binNext].binPrev = chunk.binPrev;
+    }
+    if(pool.bins[bin] == VM_CHUNK_NONE){
+        pool.binMap &= ~(1U << bin);
+    }
+}
+
+/*Gets a record for a new chunk, reusing one left over from a merge if there is one.*/
+unsigned int poolChunkNew(MemoryPool &pool, void *base, TVMMemorySize size){
+    MemoryChunk chunk = {base, size, true, VM_CHUNK_NONE, VM_CHUNK_NONE, VM_CHUNK_NONE, VM_CHUNK_NONE};
+    if(pool.spareChunks.empty()){
+        pool.memList.push_back(chunk);
+        return pool.memList.size() - 1;
+    }
+    unsigned int id = pool.spareChunks.back();
+    pool.spareChunks.pop_back();
+    pool.memList[id] = chunk;
+    return id;
+}
+
+void poolChunkRelease(MemoryPool &pool, unsigned int id){
+    pool.memList[id].base = NULL;
+    pool.memList[id].free = true;
+    pool.spareChunks.push_back(id);
+}
+
+/*Sets a pool up as a single free chunk covering all of it.*/
+void poolInit(MemoryPool &pool, TVMMemoryPoolID id, void *base, TVMMemorySize size){
+    pool.mpID = id;
+    pool.deleted = false;
+    pool.kind = VM_POOL_KIND_GENERAL;
+    pool.base = base;
+    pool.size = size;
+    pool.memList.clear();
+    pool.spareChunks.clear();
+    for(unsigned int bin = 0; bin < VM_POOL_BINS; bin++){
+        pool.bins[bin] = VM_CHUNK_NONE;
+    }
+    pool.binMap = 0;
+    pool.freeBytes = size;
+    pool.capacity = size;
+    pool.highWater = 0;
+    pool.allocated.clear();
+    pool.topChunk = poolChunkNew(pool, base, size);
+    poolBinInsert(pool, pool.topChunk);
+}
+
+/* Finds a free chunk of at least size bytes, size being a multiple of the granule. Every chunk on the first
+ * non empty list from the size's own class up is big enough, so the head of that list is taken. Only when all
+ * of those are empty is the list one class down, which holds chunks either side of size, searched for a fit.*/
+unsigned int poolFind(MemoryPool &pool, TVMMemorySize size){
+    TVMMemorySize granules = size / VM_POOL_GRANULE;
+    unsigned int bin = poolBin(size);
+    unsigned int fit = (granules & (granules - 1)) ? bin + 1 : bin;
+    unsigned int candidates = fit < VM_POOL_BINS ? pool.binMap & (~0U << fit) : 0;
+    if(candidates != 0){
+        return pool.bins[__builtin_ctz(candidates)];
+    }
+    if(fit != bin){
+        for(unsigned int id = pool.bins[bin]; id != VM_CHUNK_NONE; id = pool.memList[id].binNext){
+            if(pool.memList[id].size >= size){
+                return id;
             }
         }
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INVALID_PARAMETER;
     }
+    return VM_CHUNK_NONE;
+}
+
+/* Allocates the bottom size bytes of free chunk id, which has already been taken off its free list. A leftover
+ * of less than a granule stays part of the allocation, so every free chunk is at least a granule.*/
+void *poolCarve(MemoryPool &pool, unsigned int id, TVMMemorySize size){
+    if(pool.memList[id].size - size < VM_POOL_GRANULE){
+        size = pool.memList[id].size;
+    }
+    if(pool.memList[id].size > size){
+        /*The part left over stays free as a chunk of its own.*/
+        unsigned int rest = poolChunkNew(pool, (uint8_t *)pool.memList[id].base + size, pool.memList[id].size - size);
+        pool.memList[rest].prevChunk = id;
+        pool.memList[rest].nextChunk = pool.memList[id].nextChunk;
+        if(pool.memList[id].nextChunk != VM_CHUNK_NONE){
+            pool.memList[pool.memList[id].nextChunk].prevChunk = rest;
+        }
+        if(pool.topChunk == id){
+            pool.topChunk = rest;
+        }
+        pool.memList[id].nextChunk = rest;
+        pool.memList[id].size = size;
+        poolBinInsert(pool, rest);
+    }
+    pool.memList[id].free = false;
+    pool.freeBytes -= size;
+    pool.allocated[pool.memList[id].base] = id;
+    return pool.memList[id].base;
+}
+
+/*Allocates size bytes, rounded up to the granule, from the pool. Returns NULL if nothing free is big enough.*/
+void *poolTake(MemoryPool &pool, TVMMemorySize size){
+    if(size % VM_POOL_GRANULE != 0){
+        size = size + VM_POOL_GRANULE - (size % VM_POOL_GRANULE);
+    }
+    if(size == 0 || size > pool.freeBytes){
+        return NULL;
+    }
+    unsigned int id = poolFind(pool, size);
+    if(id == VM_CHUNK_NONE){
+        return NULL;
+    }
+    poolBinRemove(pool, id);
+    return poolCarve(pool, id, size);
 }
 
+/* Like poolTake, but the block starts on a multiple of align. The chunk found has room for the block behind
+ * the worst case padding, and the padding is split off below the block as a free chunk of its own, pushed up
+ * by align until it is at least a granule.*/
+void *poolTakeAligned(MemoryPool &pool, TVMMemorySize size, TVMMemorySize align){
+    if(size % VM_POOL_GRANULE != 0){
+        size = size + VM_POOL_GRANULE - (size % VM_POOL_GRANULE);
+    }
+    if(size == 0 || size > pool.freeBytes || align + VM_POOL_GRANULE > pool.freeBytes - size){
+        return NULL;
+    }
+    TVMMemorySize search = (size + align + 2 * VM_POOL_GRANULE - 1) & ~(TVMMemorySize)(VM_POOL_GRANULE - 1);
+    unsigned int id = poolFind(pool, search);
+    if(id == VM_CHUNK_NONE){
+        return NULL;
+    }
+    poolBinRemove(pool, id);
+    uint8_t *base = (uint8_t *)pool.memList[id].base;
+    TVMMemorySize pad = (align - ((uintptr_t)base & (align - 1))) & (align - 1);
+    while(pad != 0 && pad < VM_POOL_GRANULE){
+        pad += align;
+    }
+    if(pad != 0){
+        unsigned int block = poolChunkNew(pool, base + pad, pool.memList[id].size - pad);
+        pool.memList[block].prevChunk = id;
+        pool.memList[block].nextChunk = pool.memList[id].nextChunk;
+        if(pool.memList[id].nextChunk != VM_CHUNK_NONE){
+            pool.memList[pool.memList[id].nextChunk].prevChunk = block;
+        }
+        if(pool.topChunk == id){
+            pool.topChunk = block;
+        }
+        pool.memList[id].nextChunk = block;
+        pool.memList[id].size = pad;
+        poolBinInsert(pool, id);
+        id = block;
+    }
+    return poolCarve(pool, id, size);
+}
 
-TVMStatus VMMemoryPoolDelete(TVMMemoryPoolID memory){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    unsigned int elemPos = 0;
-    if(memory >= numPools){
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INVALID_PARAMETER;
+/*Frees the chunk allocated at base, merging it with whichever neighbours are free. Returns false if nothing
+ * was allocated there.*/
+bool poolRelease(MemoryPool &pool, void *base){
+    unordered_map<void *, unsigned int>::iterator found = pool.allocated.find(base);
+    if(found == pool.allocated.end()){
+        return false;
+    }
+    unsigned int id = found->second;
+    pool.allocated.erase(found);
+    pool.memList[id].free = true;
+    pool.freeBytes += pool.memList[id].size;
+    unsigned int next = pool.memList[id].nextChunk;
+    if(next != VM_CHUNK_NONE && pool.memList[next].free){
+        poolBinRemove(pool, next);
+        pool.memList[id].size += pool.memList[next].size;
+        pool.memList[id].nextChunk = pool.memList[next].nextChunk;
+        if(pool.memList[id].nextChunk != VM_CHUNK_NONE){
+            pool.memList[pool.memList[id].nextChunk].prevChunk = id;
+        }
+        if(pool.topChunk == next){
+            pool.topChunk = id;
+        }
+        poolChunkRelease(pool, next);
+    }
+    unsigned int prev = pool.memList[id].prevChunk;
+    if(prev != VM_CHUNK_NONE && pool.memList[prev].free){
+        poolBinRemove(pool, prev);
+        pool.memList[prev].size += pool.memList[id].size;
+        pool.memList[prev].nextChunk = pool.memList[id].nextChunk;
+        if(pool.memList[prev].nextChunk != VM_CHUNK_NONE){
+            pool.memList[pool.memList[prev].nextChunk].prevChunk = prev;
+        }
+        if(pool.topChunk == id){
+            pool.topChunk = prev;
+        }
+        poolChunkRelease(pool, id);
+        id = prev;
     }
-    for(unsigned int i = 0; i <= MemoryPoolList.size(); i++){
-        if(i == MemoryPoolList.size()){
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+    poolBinInsert(pool, id);
+    return true;
+}
+
+/* Resizes the chunk allocated at base where it is, growing into the chunk above if that one is free and big
+ * enough. Whatever the chunk ends up with past size goes back as free space. Returns false if it can't grow.*/
+bool poolResize(MemoryPool &pool, void *base, TVMMemorySize size){
+    if(size % VM_POOL_GRANULE != 0){
+        size = size + VM_POOL_GRANULE - (size % VM_POOL_GRANULE);
+    }
+    unsigned int id = pool.allocated[base];
+    if(size > pool.memList[id].size){
+        unsigned int next = pool.memList[id].nextChunk;
+        if(next == VM_CHUNK_NONE || !pool.memList[next].free || pool.memList[id].size + pool.memList[next].size < size){
+            return false;
         }
-        else if(MemoryPoolList[i].mpID == memory){
-            elemPos = i;
-            break;
+        poolBinRemove(pool, next);
+        pool.freeBytes -= pool.memList[next].size;
+        pool.memList[id].size += pool.memList[next].size;
+        pool.memList[id].nextChunk = pool.memList[next].nextChunk;
+        if(pool.memList[id].nextChunk != VM_CHUNK_NONE){
+            pool.memList[pool.memList[id].nextChunk].prevChunk = id;
+        }
+        if(pool.topChunk == next){
+            pool.topChunk = id;
+        }
+        poolChunkRelease(pool, next);
+    }
+    if(pool.memList[id].size - size < VM_POOL_GRANULE){
+        return true;
+    }
+    unsigned int rest = poolChunkNew(pool, (uint8_t *)base + size, pool.memList[id].size - size);
+    pool.memList[rest].prevChunk = id;
+    pool.memList[rest].nextChunk = pool.memList[id].nextChunk;
+    pool.memList[id].nextChunk = rest;
+    pool.memList[id].size = size;
+    pool.freeBytes += pool.memList[rest].size;
+    if(pool.topChunk == id){
+        pool.topChunk = rest;
+    }
+    unsigned int next = pool.memList[rest].nextChunk;
+    if(next != VM_CHUNK_NONE && pool.memList[next].free){
+        poolBinRemove(pool, next);
+        pool.memList[rest].size += pool.memList[next].size;
+        pool.memList[rest].nextChunk = pool.memList[next].nextChunk;
+        if(pool.topChunk == next){
+            pool.topChunk = rest;
         }
+        poolChunkRelease(pool, next);
+        next = pool.memList[rest].nextChunk;
     }
-    if(!MemoryPoolList[elemPos].memList.empty()){
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INVALID_STATE;
+    if(next != VM_CHUNK_NONE){
+        pool.memList[next].prevChunk = rest;
+    }
+    poolBinInsert(pool, rest);
+    return true;
+}
+
+/*Sets a pool up to hand out objects of objsize bytes. Returns false if not even one object fits.*/
+bool slabInit(MemoryPool &pool, TVMMemoryPoolID id, void *base, TVMMemorySize size, TVMMemorySize objsize){
+    objsize = (objsize + VM_POOL_ALIGN - 1) & ~(TVMMemorySize)(VM_POOL_ALIGN - 1);
+    uint8_t *first = (uint8_t *)(((uintptr_t)base + VM_POOL_ALIGN - 1) & ~(uintptr_t)(VM_POOL_ALIGN - 1));
+    if(objsize == 0 || first + objsize > (uint8_t *)base + size || first + objsize < first){
+        return false;
+    }
+    TVMMemorySize count = ((uint8_t *)base + size - first) / objsize;
+    pool.mpID = id;
+    pool.deleted = false;
+    pool.kind = VM_POOL_KIND_FIXED;
+    pool.base = base;
+    pool.size = size;
+    pool.freeBytes = count * objsize;
+    pool.capacity = count * objsize;
+    pool.highWater = 0;
+    pool.objSize = objsize;
+    pool.slabFirst = first;
+    pool.slabNext = first;
+    pool.slabEnd = first + count * objsize;
+    pool.slabFree = NULL;
+    pool.slabLive.assign((count + 63) / 64, 0);
+    pool.slabUsed = 0;
+    return true;
+}
+
+/*Takes an object off the free list, or the next one that has never been used. Returns NULL if none are left.*/
+void *slabTake(MemoryPool &pool){
+    uint8_t *object;
+    if(pool.slabFree != NULL){
+        object = (uint8_t *)pool.slabFree;
+        pool.slabFree = *(void **)object;
+    }
+    else if(pool.slabNext < pool.slabEnd){
+        object = pool.slabNext;
+        pool.slabNext += pool.objSize;
     }
     else{
-        MemoryPoolList.erase(MemoryPoolList.begin() + elemPos);
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_SUCCESS;
+        return NULL;
     }
+    TVMMemorySize index = (object - pool.slabFirst) / pool.objSize;
+    pool.slabLive[index / 64] |= (uint64_t)1 << (index % 64);
+    pool.slabUsed++;
+    pool.freeBytes -= pool.objSize;
+    return object;
 }
 
+/*Puts an object back on the free list. Returns false if pointer isn't an allocated object of the pool.*/
+bool slabRelease(MemoryPool &pool, void *pointer){
+    uint8_t *object = (uint8_t *)pointer;
+    if(object < pool.slabFirst || object >= pool.slabNext || (object - pool.slabFirst) % pool.objSize != 0){
+        return false;
+    }
+    TVMMemorySize index = (object - pool.slabFirst) / pool.objSize;
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if(!(pool.slabLive[index / 64] & bit)){
+        return false;
+    }
+    pool.slabLive[index / 64] &= ~bit;
+    *(void **)object = pool.slabFree;
+    pool.slabFree = object;
+    pool.slabUsed--;
+    pool.freeBytes += pool.objSize;
+    return true;
+}
 
-TVMStatus VMMemoryPoolQuery(TVMMemoryPoolID memory, TVMMemorySizeRef bytesleft){
-    TMachineSignalState sigState;
-    MachineSuspendSignals(&sigState);
-    unsigned int elemPos = 0;
-    if(memory >= numPools || bytesleft == NULL){
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_ERROR_INVALID_PARAMETER;
+void arenaInit(MemoryPool &pool, TVMMemoryPoolID id, void *base, TVMMemorySize size){
+    pool.mpID = id;
+    pool.deleted = false;
+    pool.kind = VM_POOL_KIND_ARENA;
+    pool.base = base;
+    pool.size = size;
+    pool.freeBytes = size;
+    pool.capacity = size;
+    pool.highWater = 0;
+    pool.arenaTop = (uint8_t *)base;
+    pool.arenaLast = NULL;
+}
+
+/*Bumps the top of the arena past size bytes at align, at least VM_ARENA_ALIGN. Returns NULL if they don't fit.*/
+void *arenaTake(MemoryPool &pool, TVMMemorySize size, TVMMemorySize align){
+    if(align < VM_ARENA_ALIGN){
+        align = VM_ARENA_ALIGN;
+    }
+    uint8_t *end = (uint8_t *)pool.base + pool.size;
+    uint8_t *block = (uint8_t *)(((uintptr_t)pool.arenaTop + align - 1) & ~(uintptr_t)(align - 1));
+    if(block < pool.arenaTop){
+        return NULL;
     }
-    for(unsigned int i = 0; i <= MemoryPoolList.size(); i++){
-        if(i == MemoryPoolList.size()){
-            MachineResumeSignals(&sigState);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+    if(block > end || size > (TVMMemorySize)(end - block)){
+        return NULL;
+    }
+    pool.arenaTop = block + size;
+    pool.arenaLast = block;
+    pool.freeBytes = end - pool.arenaTop;
+    return block;
+}
+
+/* Anything inside the used part of the arena can be freed, but only the most recent allocation actually gives
+ * its space back, the rest waits for a reset. Returns false if pointer isn't in the used part.*/
+bool arenaRelease(MemoryPool &pool, void *pointer){
+    uint8_t *block = (uint8_t *)pointer;
+    if(block < (uint8_t *)pool.base || block >= pool.arenaTop){
+        return false;
+    }
+    if(block == pool.arenaLast){
+        pool.arenaTop = block;
+        pool.arenaLast = NULL;
+        pool.freeBytes = (uint8_t *)pool.base + pool.size - pool.arenaTop;
+    }
+    return true;
+}
+
+/* Only the most recent allocation can be resized where it is, by moving the top of the arena. The arena keeps
+ * no sizes, so an older block can't tell a shrink from a grow and always moves. Returns false if it has to.*/
+bool arenaResize(MemoryPool &pool, void *pointer, TVMMemorySize size){
+    uint8_t *block = (uint8_t *)pointer;
+    uint8_t *end = (uint8_t *)pool.base + pool.size;
+    if(block != pool.arenaLast || size > (TVMMemorySize)(end - block)){
+        return false;
+    }
+    pool.arenaTop = block + size;
+    pool.freeBytes = end - pool.arenaTop;
+    return true;
+}
+
+void bitmapInit(BlockBitmap &bitmap, TVMMemorySize count){
+    bitmap.clear();
+    do{
+        count = (count + 63) / 64;
+        bitmap.push_back(vector<uint64_t>(count, 0));
+    }while(count > 1);
+}
+
+void bitmapSet(BlockBitmap &bitmap, TVMMemorySize bit){
+    for(unsigned int level = 0; level < bitmap.size(); level++){
+        uint64_t &word = bitmap[level][bit / 64];
+        bool wasEmpty = word == 0;
+        word |= (uint64_t)1 << (bit % 64);
+        if(!wasEmpty){
+            break;
+        }
+        bit /= 64;
+    }
+}
+
+/*Clears a bit, returns true if the bitmap is empty afterwards.*/
+bool bitmapClear(BlockBitmap &bitmap, TVMMemorySize bit){
+    for(unsigned int level = 0; level < bitmap.size(); level++){
+        uint64_t &word = bitmap[level][bit / 64];
+        word &= ~((uint64_t)1 << (bit % 64));
+        if(word != 0){
+            return false;
+        }
+        bit /= 64;
+    }
+    return true;
+}
+
+/*The lowest set bit, the bitmap must not be empty.*/
+TVMMemorySize bitmapFirst(const BlockBitmap &bitmap){
+    TVMMemorySize bit = 0;
+    for(unsigned int level = bitmap.size(); level-- > 0;){
+        bit = bit * 64 + __builtin_ctzll(bitmap[level][bit]);
+    }
+    return bit;
+}
+
+void buddyPush(MemoryPool &pool, uint8_t *block, unsigned int order){
+    bitmapSet(pool.buddyFree[order], (block - pool.buddyBase) >> order);
+    pool.buddyMap |= 1U << order;
+    pool.buddyOrders[(block - pool.buddyBase) / VM_POOL_GRANULE] = order | VM_BUDDY_FREE;
+}
+
+void buddyUnlink(MemoryPool &pool, uint8_t *block, unsigned int order){
+    if(bitmapClear(pool.buddyFree[order], (block - pool.buddyBase) >> order)){
+        pool.buddyMap &= ~(1U << order);
+    }
+    pool.buddyOrders[(block - pool.buddyBase) / VM_POOL_GRANULE] = 0;
+}
+
+/* Sets a pool up as buddy blocks. The space from the first granule boundary is covered with the largest
+ * aligned blocks that fit, so a size that isn't a power of two just has blocks whose buddies never exist.*/
+void buddyInit(MemoryPool &pool, TVMMemoryPoolID id, void *base, TVMMemorySize size){
+    uint8_t *first = (uint8_t *)(((uintptr_t)base + VM_POOL_GRANULE - 1) & ~(uintptr_t)(VM_POOL_GRANULE - 1));
+    TVMMemorySize length = 0;
+    if(first < (uint8_t *)base + size){
+        length = ((uint8_t *)base + size - first) & ~(TVMMemorySize)(VM_POOL_GRANULE - 1);
+    }
+    pool.mpID = id;
+    pool.deleted = false;
+    pool.kind = VM_POOL_KIND_BUDDY;
+    pool.base = base;
+    pool.size = size;
+    pool.freeBytes = length;
+    pool.capacity = length;
+    pool.highWater = 0;
+    pool.buddyBase = first;
+    pool.buddyLength = length;
+    for(unsigned int order = 0; order < VM_BUDDY_ORDERS; order++){
+        if(order >= VM_BUDDY_MIN_ORDER){
+            bitmapInit(pool.buddyFree[order], length >> order);
         }
-        else if(MemoryPoolList[i].mpID == memory){
-            elemPos = i;
+        else{
+            pool.buddyFree[order].clear();
+        }
+    }
+    pool.buddyMap = 0;
+    pool.buddyOrders.assign(length / VM_POOL_GRANULE, 0);
+    pool.buddyUsed = 0;
+    TVMMemorySize offset = 0;
+    while(offset < length){
+        unsigned int order = offset ? __builtin_ctz(offset) : VM_BUDDY_ORDERS - 1;
+        while(((TVMMemorySize)1 << order) > length - offset){
+            order--;
+        }
+        buddyPush(pool, first + offset, order);
+        offset += (TVMMemorySize)1 << order;
+    }
+}
+
+/* Takes the lowest free block of the smallest order with one of at least size bytes, splitting it in halves down
+ * to the order size needs. The upper half of each split is marked free at its order.*/
+void *buddyTake(MemoryPool &pool, TVMMemorySize size){
+    unsigned int order = VM_BUDDY_MIN_ORDER;
+    while(order < VM_BUDDY_ORDERS && ((TVMMemorySize)1 << order) < size){
+        order++;
+    }
+    if(order >= VM_BUDDY_ORDERS){
+        return NULL;
+    }
+    unsigned int candidates = pool.buddyMap & (~0U << order);
+    if(candidates == 0){
+        return NULL;
+    }
+    unsigned int found = __builtin_ctz(candidates);
+    uint8_t *block = pool.buddyBase + (bitmapFirst(pool.buddyFree[found]) << found);
+    buddyUnlink(pool, block, found);
+    while(found > order){
+        found--;
+        buddyPush(pool, block + ((TVMMemorySize)1 << found), found);
+    }
+    pool.buddyOrders[(block - pool.buddyBase) / VM_POOL_GRANULE] = order;
+    pool.buddyUsed++;
+    pool.freeBytes -= (TVMMemorySize)1 << order;
+    return block;
+}
+
+/*Frees a block and merges it with its buddy for as long as the buddy is free. Returns false if pointer isn't an allocated block.*/
+bool buddyRelease(MemoryPool &pool, void *pointer){
+    uint8_t *block = (uint8_t *)pointer;
+    if(block < pool.buddyBase || block >= pool.buddyBase + pool.buddyLength || (block - pool.buddyBase) % VM_POOL_GRANULE != 0){
+        return false;
+    }
+    TVMMemorySize offset = block - pool.buddyBase;
+    unsigned int order = pool.buddyOrders[offset / VM_POOL_GRANULE];
+    if(order == 0 || (order & VM_BUDDY_FREE)){
+        return false;
+    }
+    pool.buddyOrders[offset / VM_POOL_GRANULE] = 0;
+    pool.buddyUsed--;
+    pool.freeBytes += (TVMMemorySize)1 << order;
+    while(order + 1 < VM_BUDDY_ORDERS){
+        TVMMemorySize buddy = offset ^ ((TVMMemorySize)1 << order);
+        if(buddy >= pool.buddyLength || pool.buddyOrders[buddy / VM_POOL_GRANULE] != (order | VM_BUDDY_FREE)){
             break;
         }
+        buddyUnlink(pool, pool.buddyBase + buddy, order);
+        offset &= ~((TVMMemorySize)1 << order);
+        order++;
     }
-    if(MemoryPoolList[elemPos].memList.empty()){
-        *bytesleft = MemoryPoolList[elemPos].size;
-        MachineResumeSignals(&sigState);
-        return VM_STATUS_SUCCESS;
+    buddyPush(pool, pool.buddyBase + offset, order);
+    return true;
+}
+
+/* Resizes a block where it is. Shrinking frees upper halves until the block is the order size needs, growing
+ * takes in the buddy above at each order for as long as the block is the lower half and that buddy is free
+ * and whole. Returns false if it can't grow.*/
+bool buddyResize(MemoryPool &pool, void *pointer, TVMMemorySize size){
+    TVMMemorySize offset = (uint8_t *)pointer - pool.buddyBase;
+    unsigned int order = pool.buddyOrders[offset / VM_POOL_GRANULE];
+    unsigned int needed = VM_BUDDY_MIN_ORDER;
+    while(needed < VM_BUDDY_ORDERS && ((TVMMemorySize)1 << needed) < size){
+        needed++;
+    }
+    if(needed >= VM_BUDDY_ORDERS){
+        return false;
+    }
+    for(unsigned int step = order; step < needed; step++){
+        TVMMemorySize buddy = offset + ((TVMMemorySize)1 << step);
+        if((offset & ((TVMMemorySize)1 << step)) || buddy >= pool.buddyLength || pool.buddyOrders[buddy / VM_POOL_GRANULE] != (step | VM_BUDDY_FREE)){
+            return false;
+        }
+    }
+    for(; order < needed; order++){
+        buddyUnlink(pool, pool.buddyBase + offset + ((TVMMemorySize)1 << order), order);
+        pool.freeBytes -= (TVMMemorySize)1 << order;
+    }
+    while(order > needed){
+        order--;
+        buddyPush(pool, pool.buddyBase + offset + ((TVMMemorySize)1 << order), order);
+        pool.freeBytes += (TVMMemorySize)1 << order;
+    }
+    pool.buddyOrders[offset / VM_POOL_GRANULE] = order;
+    return true;
+}
+
+void poolNoteUsage(MemoryPool &pool){
+    if(pool.capacity - pool.freeBytes > pool.highWater){
+        pool.highWater = pool.capacity - pool.freeBytes;
+    }
+}
+
+/* Whether a pool can place a block on a multiple of align at all. Fixed and buddy pools only hand out blocks
+ * where their layout already puts them.*/
+bool poolCanAlign(const MemoryPool &pool, TVMMemorySize align){
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        return (((uintptr_t)pool.slabFirst | pool.objSize) & (align - 1)) == 0;
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        return ((uintptr_t)pool.buddyBase & (align - 1)) == 0;
+    }
+    return true;
+}
+
+/* Allocates from a pool of any kind. An align of 0 takes the pool's own alignment, otherwise it is a power of
+ * two the pool can place blocks on. Returns NULL if there is no room.*/
+void *poolAllocate(MemoryPool &pool, TVMMemorySize size, TVMMemorySize align){
+    void *base;
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        base = slabTake(pool);
+    }
+    else if(pool.kind == VM_POOL_KIND_ARENA){
+        base = arenaTake(pool, size, align);
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        /*A buddy block is aligned to its own size.*/
+        base = buddyTake(pool, size > align ? size : align);
+    }
+    else if(align > 1){
+        base = poolTakeAligned(pool, size, align);
+    }
+    else{
+        base = poolTake(pool, size);
+    }
+    if(base != NULL){
+        poolNoteUsage(pool);
+    }
+    return base;
+}
+
+/*Adds size bytes just above the top of a general pool as free space.*/
+void poolExtend(MemoryPool &pool, TVMMemorySize size){
+    unsigned int top = pool.topChunk;
+    if(pool.memList[top].free){
+        poolBinRemove(pool, top);
+        pool.memList[top].size += size;
     }
     else{
-        *bytesleft = 0;
-        for(unsigned int i = 0; i < MemoryPoolList[elemPos].memList.size(); i++){
-            if(MemoryPoolList[elemPos].memList[i].free){
-                *bytesleft += MemoryPoolList[elemPos].memList[i].size;
+        unsigned int added = poolChunkNew(pool, (uint8_t *)pool.base + pool.size, size);
+        pool.memList[added].prevChunk = top;
+        pool.memList[top].nextChunk = added;
+        pool.topChunk = top = added;
+    }
+    poolBinInsert(pool, top);
+    pool.size += size;
+    pool.capacity += size;
+    pool.freeBytes += size;
+}
+
+/* Commits whole extents above the top of the system pool, enough for size bytes at align on top of whatever
+ * is free there already, and adds them to the pool. Returns false once the reservation is used up.*/
+bool heapGrow(TVMMemorySize size, TVMMemorySize align){
+    MemoryPool &pool = MemoryPoolList[VM_MEMORY_POOL_ID_SYSTEM];
+    TVMMemorySize topFree = pool.memList[pool.topChunk].free ? pool.memList[pool.topChunk].size : 0;
+    /*Nothing is committed for a request the rest of the reservation couldn't hold anyway.*/
+    if(pool.size >= HeapReserved || (uint64_t)size > (uint64_t)HeapReserved - pool.size + topFree){
+        return false;
+    }
+    uint64_t target = (uint64_t)pool.size + size + align + 2 * VM_POOL_GRANULE;
+    target = (target + VM_HEAP_EXTENT - 1) & ~(uint64_t)(VM_HEAP_EXTENT - 1);
+    if(target > HeapReserved){
+        target = HeapReserved;
+    }
+    /*The page the old top is in is committed already.*/
+    uint8_t *first = (uint8_t *)((uintptr_t)(HeapBase + pool.size) & ~(uintptr_t)(VMPageSize - 1));
+    if(mprotect(first, HeapBase + target - first, PROT_READ | PROT_WRITE) != 0){
+        return false;
+    }
+    poolExtend(pool, target - pool.size);
+    return true;
+}
+
+/* Gives the extents at the top of the system pool back to the OS once they are free. An extent's worth of the
+ * free space is kept so a pool hovering around an extent boundary doesn't commit and release over and over,
+ * and the pool never drops below the size it started with.*/
+void heapTrim(){
+    MemoryPool &pool = MemoryPoolList[VM_MEMORY_POOL_ID_SYSTEM];
+    unsigned int top = pool.topChunk;
+    if(pool.size <= VMHeapSize || !pool.memList[top].free){
+        return;
+    }
+    TVMMemorySize keep = (uint8_t *)pool.memList[top].base - HeapBase + VM_HEAP_EXTENT;
+    if(keep < VMHeapSize){
+        keep = VMHeapSize;
+    }
+    keep = (keep + VM_HEAP_EXTENT - 1) & ~(TVMMemorySize)(VM_HEAP_EXTENT - 1);
+    if(keep >= pool.size){
+        return;
+    }
+    TVMMemorySize release = pool.size - keep;
+    madvise(HeapBase + keep, release, MADV_DONTNEED);
+    mprotect(HeapBase + keep, release, PROT_NONE);
+    poolBinRemove(pool, top);
+    pool.memList[top].size -= release;
+    poolBinInsert(pool, top);
+    pool.size -= release;
+    pool.capacity -= release;
+    pool.freeBytes -= release;
+}
+
+/* Allocates from the system pool. Cached thread stacks are only borrowed from it, so if it is out of room those
+ * are given back first and only then is the pool grown.*/
+void *heapAllocate(TVMMemorySize size, TVMMemorySize align){
+    MemoryPool &pool = MemoryPoolList[VM_MEMORY_POOL_ID_SYSTEM];
+    void *base = poolAllocate(pool, size, align);
+    if(base == NULL && stackCacheFlush()){
+        base = poolAllocate(pool, size, align);
+    }
+    if(base == NULL && heapGrow(size, align)){
+        base = poolAllocate(pool, size, align);
+    }
+    return base;
+}
+
+/*Frees to a pool of any kind. Returns false if pointer wasn't allocated from it.*/
+bool poolDeallocate(MemoryPool &pool, void *pointer){
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        return slabRelease(pool, pointer);
+    }
+    else if(pool.kind == VM_POOL_KIND_ARENA){
+        return arenaRelease(pool, pointer);
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        return buddyRelease(pool, pointer);
+    }
+    return poolRelease(pool, pointer);
+}
+
+/* The usable size of the block allocated at pointer, 0 if nothing is. An arena doesn't keep sizes, so an
+ * arena block counts as running up to the top of the arena.*/
+TVMMemorySize poolBlockSize(MemoryPool &pool, void *pointer){
+    uint8_t *block = (uint8_t *)pointer;
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        if(block < pool.slabFirst || block >= pool.slabNext || (block - pool.slabFirst) % pool.objSize != 0){
+            return 0;
+        }
+        TVMMemorySize index = (block - pool.slabFirst) / pool.objSize;
+        return (pool.slabLive[index / 64] >> (index % 64)) & 1 ? pool.objSize : 0;
+    }
+    else if(pool.kind == VM_POOL_KIND_ARENA){
+        if(block < (uint8_t *)pool.base || block >= pool.arenaTop){
+            return 0;
+        }
+        return pool.arenaTop - block;
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        if(block < pool.buddyBase || block >= pool.buddyBase + pool.buddyLength || (block - pool.buddyBase) % VM_POOL_GRANULE != 0){
+            return 0;
+        }
+        unsigned int order = pool.buddyOrders[(block - pool.buddyBase) / VM_POOL_GRANULE];
+        return order == 0 || (order & VM_BUDDY_FREE) ? 0 : (TVMMemorySize)1 << order;
+    }
+    unordered_map<void *, unsigned int>::iterator found = pool.allocated.find(pointer);
+    return found == pool.allocated.end() ? 0 : pool.memList[found->second].size;
+}
+
+/* Resizes an allocated block of a pool of any kind without moving it. Returns false if it would have to move.*/
+bool poolResizeInPlace(MemoryPool &pool, void *pointer, TVMMemorySize size){
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        return size <= pool.objSize;
+    }
+    else if(pool.kind == VM_POOL_KIND_ARENA){
+        return arenaResize(pool, pointer, size);
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        return buddyResize(pool, pointer, size);
+    }
+    return poolResize(pool, pointer, size);
+}
+
+/*Whether anything allocated from the pool hasn't been given back.*/
+bool poolInUse(const MemoryPool &pool){
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        return pool.slabUsed != 0;
+    }
+    else if(pool.kind == VM_POOL_KIND_ARENA){
+        return pool.arenaTop != pool.base;
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        return pool.buddyUsed != 0;
+    }
+    return !pool.allocated.empty();
+}
+
+/*The largest single allocation the pool could satisfy right now.*/
+TVMMemorySize poolLargestFree(const MemoryPool &pool){
+    if(pool.kind == VM_POOL_KIND_FIXED){
+        return pool.freeBytes ? pool.objSize : 0;
+    }
+    else if(pool.kind == VM_POOL_KIND_ARENA){
+        uint8_t *block = (uint8_t *)(((uintptr_t)pool.arenaTop + VM_ARENA_ALIGN - 1) & ~(uintptr_t)(VM_ARENA_ALIGN - 1));
+        uint8_t *end = (uint8_t *)pool.base + pool.size;
+        return block < end ? end - block : 0;
+    }
+    else if(pool.kind == VM_POOL_KIND_BUDDY){
+        return pool.buddyMap ? (TVMMemorySize)1 << (31 - __builtin_clz(pool.buddyMap)) : 0;
+    }
+    /*Only the top non empty free list can hold the largest chunk.*/
+    TVMMemorySize largest = 0;
+    if(pool.binMap != 0){
+        for(unsigned int id = pool.bins[31 - __builtin_clz(pool.binMap)]; id != VM_CHUNK_NONE; id = pool.memList[id].binNext){
+            if(pool.memList[id].size > largest){
+                largest = pool.memList[id].size;
             }
         }
-        MachineResumeSignals(&sigState);
+    }
+    return largest & ~(TVMMemorySize)(VM_POOL_GRANULE - 1);
+}
+
+TVMStatus VMMemoryPoolCreate(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory){
+    VMCriticalEnter();
+    if(base == NULL || memory == NULL || size == 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMMemoryPoolID slot = poolSlotAlloc();
+    if(slot == VM_MEMORY_POOL_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    poolInit(MemoryPoolList[slot], poolHandle(slot), base, size);
+    *memory = poolHandle(slot);
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Creates a pool that only hands out objects of objsize bytes. Objects are packed at pointer alignment with
+ * nothing stored alongside them, allocating and freeing one is a push or pop on a free list.*/
+TVMStatus VMMemoryPoolCreateFixed(void *base, TVMMemorySize size, TVMMemorySize objsize, TVMMemoryPoolIDRef memory){
+    VMCriticalEnter();
+    if(base == NULL || memory == NULL || size == 0 || objsize == 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMMemoryPoolID slot = poolSlotAlloc();
+    if(slot == VM_MEMORY_POOL_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    if(!slabInit(MemoryPoolList[slot], poolHandle(slot), base, size, objsize)){
+        MemoryPoolList[slot].deleted = true;
+        MemoryPoolFreeList.push_back(slot);
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    *memory = poolHandle(slot);
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Creates a pool that allocates by bumping a pointer. Individual frees don't give space back, except for the
+ * most recent allocation, VMMemoryPoolReset frees everything at once.*/
+TVMStatus VMMemoryPoolCreateArena(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory){
+    VMCriticalEnter();
+    if(base == NULL || memory == NULL || size == 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMMemoryPoolID slot = poolSlotAlloc();
+    if(slot == VM_MEMORY_POOL_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    arenaInit(MemoryPoolList[slot], poolHandle(slot), base, size);
+    *memory = poolHandle(slot);
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Creates a pool run as a buddy system. Allocations are rounded up to a power of two and freed blocks merge
+ * back with their buddies, so the free space can't be broken into pieces smaller than what was asked for.*/
+TVMStatus VMMemoryPoolCreateBuddy(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory){
+    VMCriticalEnter();
+    if(base == NULL || memory == NULL || size == 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    TVMMemoryPoolID slot = poolSlotAlloc();
+    if(slot == VM_MEMORY_POOL_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    buddyInit(MemoryPoolList[slot], poolHandle(slot), base, size);
+    *memory = poolHandle(slot);
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/*Frees everything allocated from an arena pool. The high water mark is kept.*/
+TVMStatus VMMemoryPoolReset(TVMMemoryPoolID memory){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    MemoryPool &pool = MemoryPoolList[memory];
+    if(pool.kind != VM_POOL_KIND_ARENA){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_STATE;
+    }
+    pool.arenaTop = (uint8_t *)pool.base;
+    pool.arenaLast = NULL;
+    pool.freeBytes = pool.size;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+TVMStatus VMMemoryPoolAllocate(TVMMemoryPoolID memory, TVMMemorySize size, void **pointer){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || size == 0 || pointer == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    ////cout << "Allocating " << size << " bytes from Memory Pool " << memory <<"\n";
+    if(MemoryPoolList[memory].kind == VM_POOL_KIND_FIXED && size > MemoryPoolList[memory].objSize){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    void *base = memory == VM_MEMORY_POOL_ID_SYSTEM ? heapAllocate(size, 0) : poolAllocate(MemoryPoolList[memory], size, 0);
+    if(base == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    *pointer = base;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Allocates size bytes starting on a multiple of align, which has to be a power of two. Page or huge page
+ * alignment is fine, a general pool just splits the padding off as free space. Fixed and buddy pools can't
+ * move their blocks, so an alignment their layout doesn't give is an invalid parameter.*/
+TVMStatus VMMemoryPoolAllocateAligned(TVMMemoryPoolID memory, TVMMemorySize size, TVMMemorySize align, void **pointer){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || size == 0 || pointer == NULL || align == 0 || (align & (align - 1)) != 0){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    MemoryPool &pool = MemoryPoolList[memory];
+    if(!poolCanAlign(pool, align) || (pool.kind == VM_POOL_KIND_FIXED && size > pool.objSize)){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    void *base = memory == VM_MEMORY_POOL_ID_SYSTEM ? heapAllocate(size, align) : poolAllocate(pool, size, align);
+    if(base == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    *pointer = base;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+TVMStatus VMMemoryPoolDeallocate(TVMMemoryPoolID memory, void *pointer){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || pointer == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if(!poolDeallocate(MemoryPoolList[memory], pointer)){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if(memory == VM_MEMORY_POOL_ID_SYSTEM){
+        heapTrim();
+    }
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Resizes a block, keeping its contents up to the smaller of the two sizes. The block grows into free space
+ * right after it or shrinks by giving its end back, it is only copied to a new block if it can't grow where it
+ * is. If that fails the old block is left as it was.*/
+TVMStatus VMMemoryPoolReallocate(TVMMemoryPoolID memory, void *pointer, TVMMemorySize size, void **newpointer){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || pointer == NULL || size == 0 || newpointer == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    MemoryPool &pool = MemoryPoolList[memory];
+    TVMMemorySize oldSize = poolBlockSize(pool, pointer);
+    if(oldSize == 0 || (pool.kind == VM_POOL_KIND_FIXED && size > pool.objSize)){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if(poolResizeInPlace(pool, pointer, size)){
+        poolNoteUsage(pool);
+        if(memory == VM_MEMORY_POOL_ID_SYSTEM){
+            heapTrim();
+        }
+        *newpointer = pointer;
+        VMCriticalLeave();
         return VM_STATUS_SUCCESS;
     }
+    void *base = memory == VM_MEMORY_POOL_ID_SYSTEM ? heapAllocate(size, 0) : poolAllocate(pool, size, 0);
+    if(base == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+    }
+    memcpy(base, pointer, oldSize < size ? oldSize : size);
+    poolDeallocate(pool, pointer);
+    if(memory == VM_MEMORY_POOL_ID_SYSTEM){
+        heapTrim();
+    }
+    *newpointer = base;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+
+TVMStatus VMMemoryPoolDelete(TVMMemoryPoolID memory){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    MemoryPool &pool = MemoryPoolList[memory];
+    if(poolInUse(pool)){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_STATE;
+    }
+    else{
+        /*The slot's lists are given back now rather than when it is next used.*/
+        pool.deleted = true;
+        pool.generation++;
+        vector<MemoryChunk>().swap(pool.memList);
+        vector<unsigned int>().swap(pool.spareChunks);
+        unordered_map<void *, unsigned int>().swap(pool.allocated);
+        vector<uint64_t>().swap(pool.slabLive);
+        vector<uint8_t>().swap(pool.buddyOrders);
+        for(unsigned int order = 0; order < VM_BUDDY_ORDERS; order++){
+            BlockBitmap().swap(pool.buddyFree[order]);
+        }
+        MemoryPoolFreeList.push_back(memory);
+        VMCriticalLeave();
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+
+TVMStatus VMMemoryPoolQuery(TVMMemoryPoolID memory, TVMMemorySizeRef bytesleft){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || bytesleft == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    *bytesleft = MemoryPoolList[memory].freeBytes;
+    if(memory == VM_MEMORY_POOL_ID_SYSTEM){
+        /*Cached stacks are given back to the pool as soon as an allocation needs them.*/
+        *bytesleft += StackCacheBytes;
+    }
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Gets how many more bytes the pool can commit beyond what VMMemoryPoolQuery reports. Only the system pool grows,
+ * into the space reserved for it, every other pool reports 0.*/
+TVMStatus VMMemoryPoolQueryReserve(TVMMemoryPoolID memory, TVMMemorySizeRef reserveref){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || reserveref == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    *reserveref = 0;
+    if(memory == VM_MEMORY_POOL_ID_SYSTEM){
+        *reserveref = HeapReserved - MemoryPoolList[memory].size;
+    }
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/*Gets the most bytes that have been allocated from the pool at once since it was created.*/
+TVMStatus VMMemoryPoolQueryHighWater(TVMMemoryPoolID memory, TVMMemorySizeRef highwater){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || highwater == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    *highwater = MemoryPoolList[memory].highWater;
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
+}
+
+/* Gets the largest block that could be allocated from the pool right now, and how fragmented its free space is
+ * as the percentage of the free bytes that lie outside that block.*/
+TVMStatus VMMemoryPoolQueryFragmentation(TVMMemoryPoolID memory, TVMMemorySizeRef largestref, unsigned int *percentref){
+    VMCriticalEnter();
+    memory = poolSlot(memory);
+    if(memory == VM_MEMORY_POOL_ID_INVALID || largestref == NULL || percentref == NULL){
+        VMCriticalLeave();
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    MemoryPool &pool = MemoryPoolList[memory];
+    *largestref = poolLargestFree(pool);
+    *percentref = 0;
+    if(pool.freeBytes > *largestref){
+        *percentref = (unsigned int)(((unsigned long long)(pool.freeBytes - *largestref) * 100) / pool.freeBytes);
+    }
+    VMCriticalLeave();
+    return VM_STATUS_SUCCESS;
 }
 
@@ -25,6 +25,10 @@ extern "C" {
                                                 
 #define VM_MUTEX_ID_INVALID                     ((TVMMutexID)-1)
                                                 
+#define VM_COND_ID_INVALID                      ((TVMCondID)-1)
+                                                
+#define VM_SEMAPHORE_ID_INVALID                 ((TVMSemaphoreID)-1)
+                                                
 #define VM_TIMEOUT_INFINITE                     ((TVMTick)0)
 #define VM_TIMEOUT_IMMEDIATE                    ((TVMTick)-1)
 
@@ -33,6 +37,8 @@ typedef unsigned int TVMStatus, *TVMStatusRef;
 typedef unsigned int TVMTick, *TVMTickRef;
 typedef unsigned int TVMThreadID, *TVMThreadIDRef;
 typedef unsigned int TVMMutexID, *TVMMutexIDRef;
+typedef unsigned int TVMCondID, *TVMCondIDRef;
+typedef unsigned int TVMSemaphoreID, *TVMSemaphoreIDRef;
 typedef unsigned int TVMThreadPriority, *TVMThreadPriorityRef;  
 typedef unsigned int TVMThreadState, *TVMThreadStateRef;  
 typedef unsigned int TVMMemoryPoolID, *TVMMemoryPoolIDRef;
@@ -52,15 +58,27 @@ TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsiz
 TVMStatus VMThreadDelete(TVMThreadID thread);
 TVMStatus VMThreadActivate(TVMThreadID thread);
 TVMStatus VMThreadTerminate(TVMThreadID thread);
+TVMStatus VMThreadExit(int exitcode);
+TVMStatus VMThreadJoin(TVMThreadID thread, TVMTick timeout, int *exitref);
 TVMStatus VMThreadID(TVMThreadIDRef threadref);
 TVMStatus VMThreadState(TVMThreadID thread, TVMThreadStateRef stateref);
+TVMStatus VMThreadStackQuery(TVMThreadID thread, TVMMemorySizeRef committedref);
 TVMStatus VMThreadSleep(TVMTick tick);
 
 TVMStatus VMMemoryPoolCreate(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolCreateFixed(void *base, TVMMemorySize size, TVMMemorySize objsize, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolCreateArena(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolCreateBuddy(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory);
 TVMStatus VMMemoryPoolDelete(TVMMemoryPoolID memory);
 TVMStatus VMMemoryPoolQuery(TVMMemoryPoolID memory, TVMMemorySizeRef bytesleft);
+TVMStatus VMMemoryPoolQueryReserve(TVMMemoryPoolID memory, TVMMemorySizeRef reserveref);
+TVMStatus VMMemoryPoolQueryHighWater(TVMMemoryPoolID memory, TVMMemorySizeRef highwater);
+TVMStatus VMMemoryPoolQueryFragmentation(TVMMemoryPoolID memory, TVMMemorySizeRef largestref, unsigned int *percentref);
 TVMStatus VMMemoryPoolAllocate(TVMMemoryPoolID memory, TVMMemorySize size, void **pointer);
+TVMStatus VMMemoryPoolAllocateAligned(TVMMemoryPoolID memory, TVMMemorySize size, TVMMemorySize align, void **pointer);
 TVMStatus VMMemoryPoolDeallocate(TVMMemoryPoolID memory, void *pointer);       
+TVMStatus VMMemoryPoolReallocate(TVMMemoryPoolID memory, void *pointer, TVMMemorySize size, void **newpointer);
+TVMStatus VMMemoryPoolReset(TVMMemoryPoolID memory);
 
 TVMStatus VMMutexCreate(TVMMutexIDRef mutexref);
 TVMStatus VMMutexDelete(TVMMutexID mutex);
@@ -68,6 +86,18 @@ TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref);
 TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout);     
 TVMStatus VMMutexRelease(TVMMutexID mutex);
 
+TVMStatus VMCondCreate(TVMCondIDRef condref);
+TVMStatus VMCondDelete(TVMCondID cond);
+TVMStatus VMCondWait(TVMCondID cond, TVMMutexID mutex, TVMTick timeout);
+TVMStatus VMCondSignal(TVMCondID cond);
+TVMStatus VMCondBroadcast(TVMCondID cond);
+
+TVMStatus VMSemaphoreCreate(TVMSemaphoreIDRef semaphoreref, unsigned int count);
+TVMStatus VMSemaphoreDelete(TVMSemaphoreID semaphore);
+TVMStatus VMSemaphoreQuery(TVMSemaphoreID semaphore, unsigned int *countref);
+TVMStatus VMSemaphoreDown(TVMSemaphoreID semaphore, TVMTick timeout);
+TVMStatus VMSemaphoreUp(TVMSemaphoreID semaphore);
+
 #define VMPrint(format, ...)        VMFilePrint ( 1,  format, ##__VA_ARGS__)
 #define VMPrintError(format, ...)   VMFilePrint ( 2,  format, ##__VA_ARGS__)
 
@@ -78,6 +108,12 @@ TVMStatus VMFileWrite(int filedescriptor, void *data, int *length);
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset);
 TVMStatus VMFilePrint(int filedescriptor, const char *format, ...);
 
+TVMStatus VMSharedBufferAllocate(TVMMemorySize size, void **pointer);
+TVMStatus VMSharedBufferRelease(void *pointer);
+TVMStatus VMSharedBufferQuery(TVMMemorySizeRef bytesleft);
+TVMStatus VMFileReadShared(int filedescriptor, void *data, int *length);
+TVMStatus VMFileWriteShared(int filedescriptor, void *data, int *length);
+
 #ifdef __cplusplus
 }
 #endif
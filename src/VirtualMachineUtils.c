@@ -19,6 +19,14 @@ TVMMainEntry VMLoadModule(const char *module){
     return (TVMMainEntry)dlsym(VMLibraryHandle, "VMMain");
 }
 
+// A module that defines VMSingleWorker depends on only one of its threads running at a time
+int VMModuleSingleWorker(void){
+    if((NULL == VMLibraryHandle)||(NULL == dlsym(VMLibraryHandle, "VMSingleWorker"))){
+        return 0;
+    }
+    return 1;
+}
+
 void VMUnloadModule(void){
     if(NULL != VMLibraryHandle){
         dlclose(VMLibraryHandle);
@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <string.h>
 
+extern int VMOptionTickless;
+extern int VMOptionPriorityInheritance;
+extern int VMOptionWorkers;
+extern int VMOptionHugePages;
+
 int main(int argc, char *argv[]){
     int TickTimeMS = 100;
     TVMMemorySize HeapSize = 0x1000000;
@@ -55,6 +60,40 @@ int main(int argc, char *argv[]){
                 return 1;
             }
         }
+        else if(0 == strcmp(argv[Offset], "-n")){
+            // Tickless idle, no alarm while nothing is runnable
+            VMOptionTickless = 1;
+        }
+        else if(0 == strcmp(argv[Offset], "-p")){
+            // Priority inheritance on mutexes
+            VMOptionPriorityInheritance = 1;
+        }
+        else if(0 == strcmp(argv[Offset], "-l")){
+            // Back the system heap with huge pages
+            VMOptionHugePages = 1;
+        }
+        else if(0 == strcmp(argv[Offset], "-w")){
+            // Number of OS threads running VM threads
+            Offset++;
+            if(Offset >= argc){
+                break;
+            }
+            if(1 != sscanf(argv[Offset],"%d",&VMOptionWorkers)){
+                fprintf(stderr,"Invalid parameter for -w of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+            if(0 >= VMOptionWorkers){
+                fprintf(stderr,"Invalid parameter for -w must be positive!\n");    
+                return 1;
+            }
+#ifdef MACHINE_CONTEXT_SIGNAL
+            // The signal trampoline sends SIGUSR1 to the whole process, with several workers any of them can take it
+            if(1 < VMOptionWorkers){
+                fprintf(stderr,"Invalid parameter for -w, more than one worker is not supported with CONTEXT_MODE=SIGNAL!\n");
+                return 1;
+            }
+#endif
+        }
         else{
             break;
         }
@@ -63,6 +102,16 @@ int main(int argc, char *argv[]){
     
     if(Offset >= argc){
         fprintf(stderr,"Syntax Error: vm [options] module [moduleoptions]\n");    
+        fprintf(stderr,"Options:\n");
+        fprintf(stderr,"  -t ms     Tick time in ms\n");
+        fprintf(stderr,"  -h bytes  Size of the system heap\n");
+        fprintf(stderr,"  -s bytes  Size of the shared space\n");
+        fprintf(stderr,"  -n        Tickless idle, no alarm while nothing is runnable\n");
+        fprintf(stderr,"  -p        Priority inheritance on mutexes\n");
+        fprintf(stderr,"  -l        Back the system heap with huge pages\n");
+        fprintf(stderr,"  -w count  Number of OS threads running VM threads. Each has its own ready queue, but one\n");
+        fprintf(stderr,"            lock covers every VM call and scheduling decision, so only thread code between\n");
+        fprintf(stderr,"            VM calls runs in parallel\n");
         return 1;
     }
     